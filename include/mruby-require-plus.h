@@ -2,6 +2,7 @@
 #define MRUBY_REQUIRE_PLUS_H 1
 
 #include <mruby.h>
+#include <stdint.h>
 
 MRB_BEGIN_DECL
 
@@ -16,16 +17,174 @@ MRB_BEGIN_DECL
 #define MRUBY_REQUIRE_PLUS_FINAL_SUFFIX         _require_plus_final
 #define MRUBY_REQUIRE_PLUS_IREP_PREFIX          MRUBY_REQUIRE_PLUS_COMMON_PREFIX
 #define MRUBY_REQUIRE_PLUS_IREP_SUFFIX          _require_plus_irep
+#define MRUBY_REQUIRE_PLUS_DESCRIPTOR_SUFFIX    _require_plus_descriptor
 #define MRUBY_REQUIRE_PLUS_INITIALIZE(NAME)     MRUBY_REQUIRE_PLUS_NAME_MAKE(MRUBY_REQUIRE_PLUS_INIT_PREFIX, NAME, MRUBY_REQUIRE_PLUS_INIT_SUFFIX)
 #define MRUBY_REQUIRE_PLUS_FINALIZE(NAME)       MRUBY_REQUIRE_PLUS_NAME_MAKE(MRUBY_REQUIRE_PLUS_FINAL_PREFIX, NAME, MRUBY_REQUIRE_PLUS_FINAL_SUFFIX)
 #define MRUBY_REQUIRE_PLUS_IREP(NAME)           MRUBY_REQUIRE_PLUS_NAME_MAKE(MRUBY_REQUIRE_PLUS_IREP_PREFIX, NAME, MRUBY_REQUIRE_PLUS_IREP_SUFFIX)
+#define MRUBY_REQUIRE_PLUS_DESCRIPTOR(NAME)     MRUBY_REQUIRE_PLUS_NAME_MAKE(MRUBY_REQUIRE_PLUS_COMMON_PREFIX, NAME, MRUBY_REQUIRE_PLUS_DESCRIPTOR_SUFFIX)
 
 typedef void mruby_require_plus_init_func(mrb_state *mrb);
 typedef void mruby_require_plus_final_func(mrb_state *mrb);
 
+/*
+ * 拡張ライブラリの記述子です。
+ *
+ * `MRUBY_REQUIRE_PLUS_DEFINE_DESCRIPTOR()` によって定義された場合、初期化関数・後処理関数・irep は
+ * 一度の `dlsym()` で取得されます。
+ * 記録された ABI の指紋が読み込む側と一致しなければ、初期化関数や irep を実行せずに `LoadError` 例外が発生します。
+ * ただし確かめるのは `dlopen()` の後であるため、再配置とライブラリの静的な初期化 (コンストラクタ) は既に行われています。
+ */
+struct mruby_require_plus_descriptor
+{
+  uint32_t magic;   /* MRUBY_REQUIRE_PLUS_DESCRIPTOR_MAGIC */
+  uint32_t release; /* MRUBY_RELEASE_NO */
+  uint32_t config;  /* MRUBY_REQUIRE_PLUS_ABI_CONFIG */
+  uint32_t flags;   /* MRUBY_REQUIRE_PLUS_UNLOADABLE など */
+  mruby_require_plus_init_func *init;
+  mruby_require_plus_final_func *final;
+  const void *irep;
+};
+
+#define MRUBY_REQUIRE_PLUS_DESCRIPTOR_MAGIC     UINT32_C(0x52502b44) /* "RP+D" */
+
+/*
+ * `RequirePlus.unload` の時に、後処理関数を呼んだ後で `dlclose()` してもよいことを示します。
+ * 指定しなければ、後処理関数を呼んでもライブラリはプロセスにマップされたまま残ります。
+ */
+#define MRUBY_REQUIRE_PLUS_UNLOADABLE           UINT32_C(0x00000001)
+
+#if defined(MRB_NAN_BOXING)
+# define MRUBY_REQUIRE_PLUS_ABI_BOXING          1
+#elif defined(MRB_WORD_BOXING)
+# define MRUBY_REQUIRE_PLUS_ABI_BOXING          2
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_BOXING          0
+#endif
+
+#if defined(MRB_WITHOUT_FLOAT)
+# define MRUBY_REQUIRE_PLUS_ABI_FLOAT           0
+#elif defined(MRB_USE_FLOAT)
+# define MRUBY_REQUIRE_PLUS_ABI_FLOAT           1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_FLOAT           2
+#endif
+
+#if defined(MRB_ENABLE_CXX_ABI) || defined(MRB_ENABLE_CXX_EXCEPTION)
+# define MRUBY_REQUIRE_PLUS_ABI_CXX             1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_CXX             0
+#endif
+
+/*
+ * 以下は mrb_state などの構造体の配置や、メソッドの表現を変えるものです。
+ */
+#if defined(MRB_GC_FIXED_ARENA)
+# define MRUBY_REQUIRE_PLUS_ABI_FIXED_ARENA     1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_FIXED_ARENA     0
+#endif
+
+#if defined(MRB_FIXED_STATE_ATEXIT_STACK)
+# define MRUBY_REQUIRE_PLUS_ABI_FIXED_ATEXIT    1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_FIXED_ATEXIT    0
+#endif
+
+#if defined(MRB_METHOD_CACHE)
+# define MRUBY_REQUIRE_PLUS_ABI_METHOD_CACHE    1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_METHOD_CACHE    0
+#endif
+
+#if defined(MRB_METHOD_TABLE_INLINE)
+# define MRUBY_REQUIRE_PLUS_ABI_METHOD_INLINE   1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_METHOD_INLINE   0
+#endif
+
+#if defined(MRB_METHOD_T_STRUCT)
+# define MRUBY_REQUIRE_PLUS_ABI_METHOD_STRUCT   1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_METHOD_STRUCT   0
+#endif
+
+#if defined(MRB_ENABLE_DEBUG_HOOK)
+# define MRUBY_REQUIRE_PLUS_ABI_DEBUG_HOOK      1
+#else
+# define MRUBY_REQUIRE_PLUS_ABI_DEBUG_HOOK      0
+#endif
+
+/*
+ * mruby のビルド設定のうち、拡張ライブラリとの互換性に関わるものを数値にしたものです。
+ * (値の埋め込み方式、浮動小数点数、`mrb_int` と `mrb_value` の大きさ、C++ ABI、
+ * GC アリーナと atexit スタックの固定、メソッドキャッシュ、メソッドの表現、デバッグフック)
+ */
+#define MRUBY_REQUIRE_PLUS_ABI_CONFIG                                   \
+  (((uint32_t)MRUBY_REQUIRE_PLUS_ABI_BOXING << 0) |                     \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_FLOAT << 4) |                      \
+   ((uint32_t)sizeof(mrb_int) << 8) |                                   \
+   ((uint32_t)sizeof(mrb_value) << 16) |                                \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_CXX << 24) |                       \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_FIXED_ARENA << 25) |               \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_FIXED_ATEXIT << 26) |              \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_METHOD_CACHE << 27) |              \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_METHOD_INLINE << 28) |             \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_METHOD_STRUCT << 29) |             \
+   ((uint32_t)MRUBY_REQUIRE_PLUS_ABI_DEBUG_HOOK << 30))
+
+#ifdef __cplusplus
+# define MRUBY_REQUIRE_PLUS_EXTERN              extern "C"
+#else
+# define MRUBY_REQUIRE_PLUS_EXTERN
+#endif
+
+#if defined(_WIN32)
+# define MRUBY_REQUIRE_PLUS_EXPORT              __declspec(dllexport)
+#elif defined(__GNUC__)
+# define MRUBY_REQUIRE_PLUS_EXPORT              __attribute__((visibility("default")))
+#else
+# define MRUBY_REQUIRE_PLUS_EXPORT
+#endif
+
+/*
+ * 拡張ライブラリの記述子を定義します。使わない要素には NULL を与えて下さい。
+ *
+ *  MRUBY_REQUIRE_PLUS_DEFINE_DESCRIPTOR(foo, MRUBY_REQUIRE_PLUS_INITIALIZE(foo), MRUBY_REQUIRE_PLUS_FINALIZE(foo), NULL);
+ */
+#define MRUBY_REQUIRE_PLUS_DEFINE_DESCRIPTOR(NAME, INIT, FINAL, IREP)   \
+  MRUBY_REQUIRE_PLUS_DEFINE_DESCRIPTOR_WITH_FLAGS(NAME, 0, INIT, FINAL, IREP)
+
+/*
+ * `FLAGS` を伴う記述子を定義します。
+ *
+ *  MRUBY_REQUIRE_PLUS_DEFINE_DESCRIPTOR_WITH_FLAGS(foo, MRUBY_REQUIRE_PLUS_UNLOADABLE, MRUBY_REQUIRE_PLUS_INITIALIZE(foo), MRUBY_REQUIRE_PLUS_FINALIZE(foo), NULL);
+ */
+#define MRUBY_REQUIRE_PLUS_DEFINE_DESCRIPTOR_WITH_FLAGS(NAME, FLAGS, INIT, FINAL, IREP) \
+  MRUBY_REQUIRE_PLUS_EXTERN MRUBY_REQUIRE_PLUS_EXPORT                   \
+  const struct mruby_require_plus_descriptor                            \
+  MRUBY_REQUIRE_PLUS_DESCRIPTOR(NAME) = {                               \
+    MRUBY_REQUIRE_PLUS_DESCRIPTOR_MAGIC,                                \
+    MRUBY_RELEASE_NO,                                                   \
+    MRUBY_REQUIRE_PLUS_ABI_CONFIG,                                      \
+    (FLAGS),                                                            \
+    (INIT), (FINAL), (IREP)                                             \
+  }
+
 /* Ruby の `require "feature"` を模した処理を行います */
 MRB_API mrb_bool mruby_require_plus_require(mrb_state *mrb, const char *feature);
 
+/*
+ * `features` をまとめて `require` します。
+ * ロードパスの走査は一度だけ行われます。戻り値は各 `require` の結果の配列です。
+ */
+MRB_API mrb_value mruby_require_plus_require_many(mrb_state *mrb, int num, const char *const features[]);
+
+/*
+ * `RequirePlus.try_require` と同じく、見つからなかった場合は例外の代わりに `nil` を返します。
+ * 読み込んだ場合は `true`、既に読み込まれていた場合は `false` となります。
+ */
+MRB_API mrb_value mruby_require_plus_try_require(mrb_state *mrb, const char *feature);
+
 /*
  * `vfs` の中の `feature` を読み込みます。拡張子は自動で補完されます。
  * `$LOAD_PATH` に含まれていない VFS を与えることが出来ますが、内部からの `require_relative` は失敗するでしょう。
@@ -47,6 +206,24 @@ MRB_API mrb_bool mruby_require_plus_load_with_vfs(mrb_state *mrb, const char *fe
  */
 MRB_API void mruby_require_plus_add_loadpath(mrb_state *mrb, mrb_value vfs, int whence);
 
+/*
+ * ロードパスの世代番号を取得します。
+ * `$:` が変更されるたびに増加するため、ロードパスに依存する結果を再利用できるかの判断に使えます。
+ * `$:` そのものの置き換えや、C から配列として変更した場合も、呼び出した時点で要素を比べて反映されます。
+ */
+MRB_API mrb_int mruby_require_plus_loadpath_generation(mrb_state *mrb);
+
+/*
+ * 起動時の一括読み込みを開始します。`mruby_require_plus_boot_end()` を呼ぶまで GC を止めます。
+ * 入れ子にすることが出来ます。
+ */
+MRB_API void mruby_require_plus_boot_begin(mrb_state *mrb);
+
+/*
+ * 起動時の一括読み込みを終了します。GC の状態を戻し、完全な GC を一度だけ行います。
+ */
+MRB_API void mruby_require_plus_boot_end(mrb_state *mrb);
+
 /*
  * VFS ハンドラオブジェクトを追加します。
  */
@@ -62,6 +239,45 @@ MRB_API size_t mruby_require_plus_loadsize_max(mrb_state *mrb);
  */
 MRB_API void mruby_require_plus_set_loadsize_max(mrb_state *mrb, size_t bytesize);
 
+/*
+ * 読み込み処理に差し込む関数の一覧です。使わない関数は NULL として下さい。
+ * `userdata` はそれぞれの関数の `ud` 引数として渡されます。
+ */
+struct mruby_require_plus_hooks
+{
+  void *userdata;
+
+  /*
+   * `require` が feature を探す前に呼ばれます。
+   * `require_relative`、`RequirePlus.require_many`、`RequirePlus.try_require`、`RequirePlus.require_async` も同様です。
+   */
+  void (*before_resolve)(mrb_state *mrb, void *ud, const char *feature);
+
+  /* `require` が feature を探した後に呼ばれます。見つからなかった場合 `signature` は NULL です */
+  void (*after_resolve)(mrb_state *mrb, void *ud, const char *feature, const char *signature);
+
+  /*
+   * ".rb" ファイルをコンパイルする前に呼ばれます。`code` はソースコードです。
+   * NULL 以外を返すとコンパイルを行わず、その手続きオブジェクトを実行します。
+   */
+  struct RProc *(*before_compile)(mrb_state *mrb, void *ud, const char *signature, const char *code, size_t size);
+
+  /* feature を読み込み、実行し終えた後に呼ばれます */
+  void (*after_load)(mrb_state *mrb, void *ud, const char *signature);
+
+  /*
+   * `require` が例外によって中断される時に呼ばれます。例外はこの後も伝わります。
+   * 入れ子の `require` を通して伝わる例外については、最も内側の feature について一度だけ呼ばれます。
+   */
+  void (*on_failure)(mrb_state *mrb, void *ud, const char *feature, mrb_value exc);
+};
+
+/*
+ * 読み込み処理に差し込む関数を `mrb` に登録します。`hooks` の内容は複製されます。
+ * NULL を与えると登録を解除します。
+ */
+MRB_API void mruby_require_plus_set_hooks(mrb_state *mrb, const struct mruby_require_plus_hooks *hooks);
+
 MRB_END_DECL
 
 #endif /* MRUBY_REQUIRE_PLUS_H */
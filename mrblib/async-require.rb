@@ -0,0 +1,45 @@
+#!ruby
+
+module RequirePlus
+  #
+  # `RequirePlus.require_async` の戻り値です。
+  #
+  # `done?` が真になってから `value` を呼ぶと、ファイルの読み込みを待たずにコンパイルと実行だけが行われます。
+  # `done?` が偽のうちに `value` を呼んだ場合は、読み込みが終わるまで待ちます。
+  #
+  class AsyncRequire
+    attr_reader :feature
+
+    def initialize(feature, generation, entry, reader)
+      @feature = feature
+      @generation = generation
+      @entry = entry
+      @reader = reader
+      @finished = false
+    end
+
+    def done?
+      @finished || @reader.nil? || @reader.done?
+    end
+
+    #
+    # 読み込みを完了させ、`require` と同じく true か false を返します。
+    # 読み込みに失敗した場合は、その例外を (何度呼んでも) 発生させます。
+    #
+    def value
+      unless @finished
+        @finished = true
+        begin
+          @value = Central.finish_async(@feature, @generation, @entry, @reader)
+        rescue Exception => e
+          @error = e
+        ensure
+          @entry = @reader = nil
+        end
+      end
+
+      raise @error if @error
+      @value
+    end
+  end
+end
@@ -0,0 +1,212 @@
+#!ruby
+
+module RequirePlus
+  #
+  # 遅い VFS オブジェクトを包み、読み込んだ内容をローカルのディレクトリに保持します。
+  #
+  # 内容は SHA-256 の十六進数を名前とするファイル (`<digest>.data`) として保存され、
+  # パスごとのメタデータ (`<key>.meta`) がそれを指します。読み込む時には内容の SHA-256 を確かめます。
+  # 包まれた VFS オブジェクトが `.digest(path)` か `.mtime(path)` を持つ場合、その戻り値 (元のファイルの刻印) が
+  # 変わったメタデータは破棄されます。
+  # どちらも持たない場合は一度保存された内容が使われ続けるため、更新したときはディレクトリを削除して下さい。
+  #
+  # `.file?`、`.size`、`.lookup` による探索の結果も、見つからなかったものを含めて `<key>.probe` として保存されます。
+  # 結果は探索したパス (見つからなかった場合は候補のすべて) の刻印とともに記録され、内容と同じく刻印が変われば破棄されます。
+  # そのため二度目以降の起動では、刻印を取る以外に包まれた VFS オブジェクトへの問い合わせを行いません。
+  #
+  # `.to_path` は包まれた VFS オブジェクトのものを返すため、シグネチャや `require_relative` の基点は
+  # 包む前と変わりません。`.lookup`、`.read_many`、`.mtime`、`.identity`、`.compile_profile` は、
+  # 包まれた VFS オブジェクトが持つ場合にだけ、それを用いて応答します。
+  #
+  #   $: << RequirePlus::CachingVFS.new(MyVFS.new, dir: "/var/cache/myapp")
+  #
+  class CachingVFS
+    attr_reader :inner, :dir
+
+    def initialize(inner, opts = {})
+      @inner = inner
+      @dir = opts[:dir] or raise ArgumentError, "missing keyword: dir"
+      @prefix = Central.make_prefix(inner)
+      @entries = {} # path => [digest, size] or false
+      @probes = {}  # probe name => result
+    end
+
+    def to_path
+      @inner.to_path
+    end
+
+    def file?(path)
+      entry(path) ? true : !stat(path).nil?
+    end
+
+    def size(path)
+      (e = entry(path)) ? e[1] : stat(path)
+    end
+
+    def read(path)
+      data = cached(path)
+      return data if data
+
+      data = @inner.read(path)
+      store(path, data) if data
+      data
+    end
+
+    DELEGATES = [:lookup, :read_many, :mtime, :identity, :compile_profile].freeze unless const_defined?(:DELEGATES)
+
+    #
+    # 包まれた VFS オブジェクトが持つ任意のメソッドにだけ応答する。
+    #
+    def respond_to?(name, include_all = false)
+      DELEGATES.include?(name) ? @inner.respond_to?(name) : super
+    end
+
+    def lookup(feature, extensions)
+      result = probe("lookup", feature, *extensions) do
+        (path, size, kind) = @inner.lookup(feature, extensions)
+        if path
+          ["#{path}\0#{size}\0#{kind}", [path]]
+        else
+          ["", [feature, *extensions.map { |e| feature + e }]]
+        end
+      end
+      return nil if result.empty?
+
+      (path, size, kind) = result.split("\0")
+      [path, (size.nil? || size.empty?) ? nil : size.to_i, (kind.nil? || kind.empty?) ? nil : kind.to_sym]
+    end
+
+    #
+    # 保存されている内容はそこから読み込み、残りをまとめて包まれた VFS オブジェクトから読み込む。
+    #
+    def read_many(paths)
+      result = []
+      missing = []
+      paths.each_with_index do |path, i|
+        data = cached(path)
+        result[i] = data
+        missing << i unless data
+      end
+      return result if missing.empty?
+
+      data = @inner.read_many(missing.map { |i| paths[i] })
+      missing.each_with_index do |i, j|
+        d = data && (data.kind_of?(Hash) ? data[paths[i]] : data[j])
+        next unless d
+        store(paths[i], d)
+        result[i] = d
+      end
+
+      result
+    end
+
+    def mtime(path)
+      @inner.mtime(path)
+    end
+
+    def identity(path)
+      @inner.identity(path)
+    end
+
+    def compile_profile
+      @inner.compile_profile
+    end
+
+    private
+
+    def cached(path)
+      e = entry(path)
+      return nil unless e
+
+      data = Central.sysfile_read(@dir, e[0] + ".data")
+      (data && Central.hexdigest(data) == e[0]) ? data : nil
+    end
+
+    def metaname(path)
+      Central.hexdigest("#{@prefix}\0#{path}") + ".meta"
+    end
+
+    #
+    # 元のファイルの刻印。これが変わったメタデータは破棄される。
+    #
+    def inner_stamp(path)
+      if @inner.respond_to?(:digest)
+        @inner.digest(path).to_s
+      elsif @inner.respond_to?(:mtime)
+        @inner.mtime(path).to_s
+      else
+        ""
+      end
+    end
+
+    #
+    # ファイルが存在すればその大きさを、存在しなければ nil を返す。
+    #
+    def stat(path)
+      result = probe("stat", path) do
+        [@inner.file?(path) ? @inner.size(path).to_s : "", [path]]
+      end
+      result.empty? ? nil : result.to_i
+    end
+
+    #
+    # 包まれた VFS オブジェクトへの問い合わせの結果を保存し、再利用する。
+    #
+    # ブロックは結果の文字列と、結果を確かめるために刻印を取るパスの配列を返す。
+    # 保存されたファイルは 1 行目が結果、続く行が `パス\0刻印` となる。
+    #
+    def probe(*key)
+      name = Central.hexdigest("#{@prefix}\0#{key.join("\0")}") + ".probe"
+      result = @probes[name]
+      return result if result
+
+      data = Central.sysfile_read(@dir, name)
+      if data
+        lines = data.split("\n")
+        result = lines.shift || ""
+        valid = lines.all? do |line|
+          (path, stamp) = line.split("\0", 2)
+          (stamp || "") == probe_stamp(path)
+        end
+        return @probes[name] = result if valid
+      end
+
+      (result, paths) = yield
+      stamps = paths.map { |path| "#{path}\0#{probe_stamp(path)}\n" }.join
+      Central.sysfile_write(@dir, name, "#{result}\n#{stamps}")
+      @probes[name] = result
+    end
+
+    #
+    # 存在しないパスの刻印は、包まれた VFS オブジェクトによっては例外となるため、その場合は空とする。
+    #
+    def probe_stamp(path)
+      inner_stamp(path)
+    rescue StandardError
+      ""
+    end
+
+    def entry(path)
+      e = @entries[path]
+      return e unless e.nil?
+
+      meta = Central.sysfile_read(@dir, metaname(path))
+      (digest, size, stamp) = meta.split("\n") if meta
+      if digest && size && (stamp || "") == inner_stamp(path)
+        @entries[path] = [digest, size.to_i]
+      else
+        @entries[path] = false
+      end
+    end
+
+    def store(path, data)
+      digest = Central.hexdigest(data)
+      unless Central.sysfile_size(@dir, digest + ".data") == data.bytesize
+        return nil unless Central.sysfile_write(@dir, digest + ".data", data)
+      end
+      Central.sysfile_write(@dir, metaname(path), "#{digest}\n#{data.bytesize}\n#{inner_stamp(path)}\n")
+      @entries[path] = [digest, data.bytesize]
+      nil
+    end
+  end
+end
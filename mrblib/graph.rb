@@ -0,0 +1,160 @@
+#!ruby
+
+module RequirePlus
+  #
+  # feature の読み込みの入れ子関係を記録します。
+  #
+  # 各ノードはシグネチャ単位で、読み込みにかかった時間 (入れ子の読み込みを含む `inclusive` と
+  # 含まない `exclusive`、単位は秒) と、読み込んだファイルのバイト数を持ちます。
+  #
+  # 記録は `RequirePlus.profile = true` の間に読み込まれた feature についてのみ行われます。
+  #
+  class Graph
+    Node = Struct.new(:signature, :parents, :children, :inclusive, :exclusive, :bytes)
+
+    NODES = {} unless const_defined?(:NODES)
+    STACK = [] unless const_defined?(:STACK)
+
+    def Graph.enter(signature)
+      node = (NODES[signature] ||= Node.new(signature, [], [], 0.0, 0.0, 0))
+      if parent = STACK.last
+        parent[0].children << signature unless parent[0].children.include?(signature)
+        node.parents << parent[0].signature unless node.parents.include?(parent[0].signature)
+      end
+
+      # [node, 開始時刻, 入れ子の読み込みにかかった時間]
+      STACK << [node, Central.clock, 0.0]
+      nil
+    end
+
+    def Graph.leave
+      (node, start, nested) = STACK.pop
+      elapsed = Central.clock - start
+      node.inclusive += elapsed
+      node.exclusive += elapsed - nested
+      STACK.last[2] += elapsed unless STACK.empty?
+      nil
+    end
+
+    def Graph.add_bytes(bytes)
+      STACK.last[0].bytes += bytes unless STACK.empty?
+      nil
+    end
+
+    #
+    # `signature` のノードと、それを指す辺を取り除く。
+    #
+    def Graph.remove(signature)
+      node = NODES.delete(signature)
+      return nil unless node
+
+      node.parents.each { |sig| (n = NODES[sig]) && n.children.delete(signature) }
+      node.children.each { |sig| (n = NODES[sig]) && n.parents.delete(signature) }
+      nil
+    end
+
+    def Graph.snapshot
+      nodes = {}
+      NODES.each_pair do |sig, n|
+        nodes[sig] = Node.new(sig, n.parents.dup, n.children.dup, n.inclusive, n.exclusive, n.bytes)
+      end
+
+      new(nodes)
+    end
+
+    attr_reader :nodes
+
+    def initialize(nodes)
+      @nodes = nodes
+    end
+
+    def [](signature)
+      @nodes[signature]
+    end
+
+    def edges
+      e = []
+      @nodes.each_value do |n|
+        n.children.each { |c| e << [n.signature, c] }
+      end
+      e
+    end
+
+    def roots
+      @nodes.values.select { |n| n.parents.empty? }
+    end
+
+    #
+    # 根から葉へ向かって、`inclusive` が最も大きい子を辿った経路をノードの配列で返します。
+    #
+    def critical_path
+      path = []
+      node = Graph.heaviest(roots)
+      while node
+        path << node
+        node = Graph.heaviest(node.children.map { |c| @nodes[c] }.compact.reject { |c| path.include?(c) })
+      end
+      path
+    end
+
+    def Graph.heaviest(nodes)
+      nodes.inject(nil) { |a, n| (a.nil? || n.inclusive > a.inclusive) ? n : a }
+    end
+
+    def to_dot
+      dot = "digraph \"require\" {\n"
+      @nodes.each_value do |n|
+        # ラベルの "\\n" は DOT の改行であるため、その前後を別々にエスケープする
+        stats = "#{ms(n.inclusive)} ms (self #{ms(n.exclusive)} ms), #{n.bytes} bytes"
+        dot << "  #{Graph.quote(n.signature)} [label=\"#{Graph.escape(n.signature)}\\n#{Graph.escape(stats)}\"];\n"
+      end
+      edges.each do |(a, b)|
+        dot << "  #{Graph.quote(a)} -> #{Graph.quote(b)};\n"
+      end
+      dot << "}\n"
+    end
+
+    def to_json
+      json = "{\"nodes\":["
+      json << @nodes.values.map { |n|
+        "{\"signature\":#{Graph.quote(n.signature)},\"inclusive\":#{n.inclusive},\"exclusive\":#{n.exclusive},\"bytes\":#{n.bytes}}"
+      }.join(",")
+      json << "],\"edges\":["
+      json << edges.map { |(a, b)| "[#{Graph.quote(a)},#{Graph.quote(b)}]" }.join(",")
+      json << "],\"critical_path\":["
+      json << critical_path.map { |n| Graph.quote(n.signature) }.join(",")
+      json << "]}"
+    end
+
+    def Graph.quote(str)
+      "\"#{Graph.escape(str)}\""
+    end
+
+    def Graph.escape(str)
+      q = ""
+      str.each_char do |c|
+        case c
+        when "\""
+          q << "\\\""
+        when "\\"
+          q << "\\\\"
+        when "\n"
+          q << "\\n"
+        else
+          if c.ord < 0x20
+            q << "\\u00" << ("0" + c.ord.to_s(16))[-2, 2]
+          else
+            q << c
+          end
+        end
+      end
+      q
+    end
+
+    private
+
+    def ms(sec)
+      (sec * 1000).round(3)
+    end
+  end
+end
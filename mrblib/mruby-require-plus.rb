@@ -4,20 +4,37 @@ module RequirePlus
   module Kernel
     def require(feature)
       #p Central.get_upper_frame
+      return false if Central.provided?(feature)
+      Central.sysdir_refresh
+      if Central.hooked?
+        ret = Central.hooked_require(feature, $:, feature, "cannot load such file - #{feature}")
+        Central.index_feature(feature)
+        return ret
+      end
+
       $:.each do |vfs|
         ret = Central.trial_require(vfs, feature)
-        return ret unless ret.nil?
+        unless ret.nil?
+          Central.index_feature(feature)
+          return ret
+        end
       end
 
       raise LoadError, "cannot load such file - #{feature}"
     end
 
     def require_relative(feature)
+      Central.sysdir_refresh
       upper = Central.get_upper_frame[0]
       #p Kernel.caller(0, 1)[0]
       #p upper
       (vfs, dirname) = Central.findvfs(upper)
       #puts "#{__FILE__}(#{__LINE__})#{__method__}" => [vfs, dirname, feature]
+      if Central.hooked?
+        return Central.hooked_require(feature, [vfs], Central.makepath(dirname, feature),
+                                      "cannot load such file - #{feature}") if vfs
+        return Central.hooked_require(feature, [], feature, "mismatch VFS by #{upper}")
+      end
       raise LoadError, "mismatch VFS by #{upper}" unless vfs
 
       path = Central.makepath(dirname, feature)
@@ -28,44 +45,460 @@ module RequirePlus
     end
 
     def load(file)
-      # 現在の作業ディレクトリから探索する
-      case Central.extname(file)
-      when ".rb"
-        vfs = VFSFile.new(Dir.pwd)
-        return Central.load_as_rb(vfs, file)
-      #when ".mrb"
-      #  return Central.load_as_mrb(vfs, file)
-      else
-        raise LoadError, file
-      end
+      Central.load_file(file.to_str)
+    end
+
+    def autoload(const, feature)
+      Object.autoload(const, feature)
+    end
+
+    def autoload?(const)
+      Object.autoload?(const)
+    end
+  end
+
+  #
+  # 定数が最初に参照された時に `require` するための仕組みです。
+  #
+  # `Module#autoload` によって登録された定数は `Module#const_missing` で拾われます。
+  # 一度 `require` を試みた定数は登録から除外されるため、読み込み中の再参照によって
+  # 重複して `require` されることはありません。
+  #
+  module Autoload
+    def autoload(const, feature)
+      Central.autoload_regist(self, const, feature)
+      nil
+    end
+
+    def autoload?(const)
+      Central.autoload_feature(self, const)
+    end
+  end
+
+  #
+  # fork() する前に `features` を読み込み、ヒープを整理します。
+  #
+  # 読み込みの後に作業スレッド (predlopen と require_async) の終了を待ち、GC を完全に行い、
+  # irep を読み込み専用のページへ詰め直してから、解放された領域を可能な限り OS へ返却します。
+  # 子プロセスで共有が解かれるページを減らすことが目的です。
+  #
+  def RequirePlus.preload_for_fork(features)
+    Central.deep_each(features) { |f| require f }
+    Central.settle_heap
+    nil
+  end
+
+  #
+  # `features` をまとめて `require` します。戻り値は各 `require` の結果の配列です。
+  #
+  # ロードパスの走査は一度だけ行われ、`$:` の各要素に対して未解決の feature をまとめて探します。
+  #
+  def RequirePlus.require_many(features)
+    Central.require_many(features)
+  end
+
+  #
+  # `require` と同様に `feature` を読み込みますが、見つからなかった場合は `LoadError` の代わりに nil を返します。
+  # 読み込んだ場合は true、既に読み込まれていた場合は false を返します。
+  #
+  # 見つからなかった結果は `$:` が変更されるまで記憶され、二度目以降は探索を行いません。
+  # 読み込んだファイルの中で発生した例外 (入れ子の `require` による `LoadError` を含みます) はそのまま伝わります。
+  #
+  def RequirePlus.try_require(feature)
+    Central.try_require(feature)
+  end
+
+  #
+  # `feature` を非同期に `require` します。戻り値は `RequirePlus::AsyncRequire` のインスタンスです。
+  #
+  # 探索はその場で行われ、ファイルシステム上のファイルの読み込みは作業スレッドで行われます。
+  # コンパイルと実行は、戻り値の `value` を呼んだ時に mruby のスレッドで行われます。
+  #
+  #   req = RequirePlus.require_async("plugin/foo")
+  #   Fiber.yield until req.done?
+  #   req.value # => true or false
+  #
+  def RequirePlus.require_async(feature)
+    Central.require_async(feature)
+  end
+
+  #
+  # `require` された feature を読み込まれていない状態に戻します。
+  # `feature` には `require` に与えた名前か、`$"` の要素 (シグネチャ) を与えることが出来ます。
+  #
+  # 共有オブジェクトであれば後処理関数を呼びます。
+  # 記述子で `MRUBY_REQUIRE_PLUS_UNLOADABLE` が指定されている場合に限り、GC を行った後に `dlclose()` します。
+  # 定義されたクラスやメソッド、定数は取り除かれないため、必要であれば後処理関数で取り除いて下さい。
+  #
+  # `feature` が `require` されておらず、`load` したファイル名であれば、`load` が保持しているコンパイル済みの手続きを手放します。
+  #
+  # 読み込まれていなかった場合は false を返します。
+  #
+  def RequirePlus.unload(feature)
+    Central.unload(feature)
+  end
+
+  #
+  # `features` のうち、ファイルシステム上の共有オブジェクトとして見つかったものを作業スレッドで先に `dlopen()` しておきます。
+  # 戻り値は先行読み込みを開始した feature の数です。
+  #
+  # 初期化関数と irep の実行は、後で `require` した時に行われます。
+  #
+  def RequirePlus.predlopen(features)
+    Central.predlopen(features)
+  end
+
+  #
+  # ロードパスの要素 (ディレクトリを示す文字列か VFS オブジェクト) ごとのコンパイル設定を行います。
+  #
+  # - `debug: false` - ファイル名・行番号情報を生成しません。
+  #   irep の大きさは減りますが、スタックトレースや `__FILE__`、`require_relative` が機能しなくなります。
+  # - `optimize: false` - 覗き穴最適化を行いません。
+  #
+  # `opts` に `nil` を与えると設定を取り除きます。
+  #
+  def RequirePlus.set_compile_profile(entry, opts)
+    if opts.nil?
+      Central::COMPILE_PROFILES.delete(entry)
+    else
+      Central::COMPILE_PROFILES[entry] = opts.dup
+    end
+
+    nil
+  end
+
+  def RequirePlus.compile_profile(entry)
+    Central::COMPILE_PROFILES[entry]
+  end
+
+  #
+  # `$"` にある feature ごとのメモリ使用量を、多い順に `[signature, { total:, irep:, iseq:, pool:, syms:, debug:, so:, heap: }]` の配列として返します (単位はバイト)。
+  #
+  # - `irep` - コンパイル・読み込みによって作られた irep の大きさ (`iseq`、`pool`、`syms`、`debug` はその内訳)
+  # - `so` - 共有オブジェクトのファイルの大きさ (マップされたページの量ではありません)
+  # - `heap` - 最上位の実行の前後で増えたヒープの量 (入れ子の feature の分を除きます)。
+  #   `RequirePlus.profile = true` の間に読み込まれた feature のみ記録されます。
+  #
+  # 計測できなかった項目は含まれません。
+  #
+  def RequirePlus.memory_report
+    loaded = {}
+    $".each { |sig| loaded[sig] = true }
+
+    report = []
+    Central.memory_table.each_pair do |sig, entry|
+      next unless loaded[sig]
+      entry = entry.dup
+      entry[:total] = (entry[:irep] || 0) + (entry[:so] || 0) + (entry[:heap] || 0)
+      report << [sig, entry]
     end
+
+    report.sort { |a, b| b[1][:total] <=> a[1][:total] }
+  end
+
+  #
+  # これまでに読み込まれた feature の依存関係を返します。
+  #
+  def RequirePlus.graph
+    Graph.snapshot
+  end
+
+  #
+  # ブロックの実行中は GC を止め、終了時に一度だけ完全な GC を行います。
+  # 起動時に大量の feature を読み込む場合に用いて下さい。
+  #
+  def RequirePlus.boot
+    Central.boot_begin
+    begin
+      yield
+    ensure
+      Central.boot_end
+    end
+  end
+
+  def RequirePlus.autoload(const, feature)
+    Central.autoload_regist(Object, const, feature)
+    nil
   end
 
   module Central
     SOTYPES = [".so"] unless const_defined?(:SOTYPES)
+    ZEXT = ".z" unless const_defined?(:ZEXT)
+
+    #
+    # C から登録されたフック (`mruby_require_plus_set_hooks()`) がある場合の、feature の探索と読み込みの実体。
+    # `require`、`require_relative`、`RequirePlus.try_require` から呼ばれる。
+    #
+    # `vfses` の順に `name` を探して読み込む。
+    # 見つからなければ `missing` を伝言とする `LoadError` 例外を発生させるが、`missing` が nil であれば nil を返す。
+    #
+    def Central.hooked_require(feature, vfses, name, missing)
+      hook_before_resolve(feature)
+
+      vfses.each do |vfs|
+        (kind, path) = resolve(vfs, name)
+        next unless kind
+        hook_after_resolve(feature, make_signature(vfs, path))
+        return load_resolved(vfs, kind, path)
+      end
+
+      hook_after_resolve(feature, nil)
+      raise LoadError, missing if missing
+      nil
+    rescue Exception => e
+      report_failure(feature, e)
+      raise
+    end
+
+    #
+    # `on_failure` フックを呼ぶ。
+    #
+    # 入れ子の `require` から伝わってきた例外は、最も内側の feature について一度だけ通知する。
+    # 通知したことは例外オブジェクト自身に印を付けて覚えるため、例外を保持し続けることはない。
+    #
+    def Central.report_failure(feature, e)
+      return unless hooked?
+      return if e.instance_variable_defined?(:@require_plus_reported)
+      e.instance_variable_set(:@require_plus_reported, true) unless e.frozen?
+      hook_on_failure(feature, e)
+      nil
+    end
 
     def Central.trial_require(vfs, feature)
+      (kind, path) = Central.resolve(vfs, feature)
+      return nil unless kind
+      Central.load_resolved(vfs, kind, path)
+    end
+
+    #
+    # `vfs` の中から `feature` を探し、見つかれば `[kind, path]` を返す。
+    # `kind` は `:rb`、`:mrb`、`:so` のいずれか。
+    #
+    def Central.resolve(vfs, feature)
+      case vfs
+      when String, SystemVFS
+        ;
+      else
+        return lookup(vfs, feature) if vfs.respond_to?(:lookup)
+      end
+
       case
       when rb = Central.find_rbfile(vfs, feature)
-        Central.load_as_rb(vfs, rb)
-        true
+        [:rb, rb]
       when mrb = Central.find_mrbfile(vfs, feature)
-        Central.load_as_mrb(vfs, mrb)
-        true
+        [:mrb, mrb]
       when so = Central.find_sofile(vfs, feature)
-        Central.load_as_so(vfs, so)
-        true
+        [:so, so]
+      else
+        nil
+      end
+    end
+
+    # 利用者定義の VFS に渡されるため、書き換えられないようにしておく
+    LOOKUP_EXTS = [".rb", ".rb" + ZEXT, ".mrb", ".mrb" + ZEXT, *SOTYPES].map { |e| e.dup.freeze }.freeze unless const_defined?(:LOOKUP_EXTS)
+
+    #
+    # 利用者定義の VFS が `.lookup(feature, extensions)` を持つ場合に、一度の呼び出しで探索する。
+    #
+    # VFS は `feature` そのもの、あるいは `feature + extensions[i]` を `extensions` の順に探し、
+    # 最初に見つかったものを `[path, size, kind]` として返す (見つからなければ nil)。
+    # `kind` は `:rb`、`:mrb`、`:so` のいずれかで、nil であれば拡張子から判断される。
+    #
+    def Central.lookup(vfs, feature)
+      (path, size, kind) = vfs.lookup(feature, LOOKUP_EXTS)
+      return nil unless path
+      return nil if size && size >= RequirePlus.loadsize_max
+
+      kind ||= kind_of_path(path)
+      kind ? [kind.to_sym, path] : nil
+    end
+
+    def Central.kind_of_path(path)
+      case
+      when extname?(path, ".rb"), extname?(path, ".rb" + ZEXT)
+        :rb
+      when extname?(path, ".mrb"), extname?(path, ".mrb" + ZEXT)
+        :mrb
+      when SOTYPES.any? { |e| extname?(path, e) }
+        :so
+      else
+        nil
+      end
+    end
+
+    def Central.load_resolved(vfs, kind, path)
+      case kind
+      when :rb
+        Central.load_as_rb(vfs, path)
+      when :mrb
+        Central.load_as_mrb(vfs, path)
+      when :so
+        Central.load_as_so(vfs, path)
+      else
+        raise ArgumentError, "wrong kind - #{kind.inspect}"
+      end
+
+      true
+    end
+
+    #
+    # ロードパスを一度だけ走査して、まだ見つかっていない全ての feature を探す。
+    # ファイルシステム上のロードパスでは、feature のディレクトリごとに一覧を一度だけ読んで突き合わせる。
+    # 読み込みは `features` の順に行う。
+    #
+    # 読み込みの途中でロードパスが変更された場合、残りは `require` と同じ手順で探索し直す。
+    #
+    def Central.require_many(features)
+      sysdir_refresh
+      features = features.map { |f| f.to_str }
+      # フックは feature ごとに探索の前後で呼ぶ必要があるため、まとめて探さない
+      return features.map { |f| require f } if hooked?
+      pending = features.reject { |f| provided?(f) }.uniq
+      found = {}
+      generation = loadpath_generation
+
+      $:.dup.each do |vfs|
+        break if pending.empty?
+        paths = batch_resolve(vfs, pending)
+        rest = []
+        pending.each_with_index do |f, i|
+          path = paths ? paths[i] : false
+          if path == false
+            (kind, path) = resolve(vfs, f)
+          else
+            kind = path && kind_of_path(path)
+          end
+
+          if kind
+            found[f] = [vfs, kind, path]
+          else
+            rest << f
+          end
+        end
+        pending = rest
+      end
+
+      prefetched = prefetch(found.values)
+      found.each_value { |(vfs, kind, path)| predlopen_entry(vfs, path) if kind == :so }
+
+      features.map do |f|
+        if provided?(f)
+          false
+        elsif loadpath_generation != generation
+          require f
+        elsif entry = found.delete(f)
+          ret = load_resolved(*entry)
+          index_feature(f)
+          ret
+        else
+          raise LoadError, "cannot load such file - #{f}"
+        end
+      end
+    ensure
+      # 入れ子の require_many が外側の先読みを捨てないように、自分が加えたものだけを取り除く
+      forget_prefetch(prefetched) if prefetched
+    end
+
+    BATCH_GROUPS = [[".rb", ZEXT], [".mrb", ZEXT], [SOTYPES, nil]] unless const_defined?(:BATCH_GROUPS)
+
+    #
+    # ファイルシステム上のロードパスであれば、`features` をディレクトリごとにまとめて探す。
+    # 戻り値は Central.find_sysfiles を参照。まとめて探せなければ nil を返す。
+    #
+    # 候補の順は Central.resolve (find_rbfile、find_mrbfile、find_sofile) と同じである。
+    #
+    def Central.batch_resolve(vfs, features)
+      case vfs
+      when String
+        find_sysfiles(vfs, features, BATCH_GROUPS)
+      when SystemVFS
+        find_sysfiles(vfs.basedir, features, BATCH_GROUPS)
       else
         nil
       end
     end
 
+    PREFETCH = {} unless const_defined?(:PREFETCH)
+
+    #
+    # `.read_many(paths)` を持つ VFS に対して、まとめて読み込んでおく。
+    # 読み込んだ内容は Central.read_file で一度だけ使われる。
+    #
+    # 戻り値は加えた `[vfs, path]` の配列で、使われずに残った分は Central.forget_prefetch で取り除く。
+    #
+    def Central.prefetch(entries)
+      groups = {}
+      entries.each do |(vfs, kind, path)|
+        next if vfs.kind_of?(String) || vfs.kind_of?(SystemVFS)
+        next unless vfs.respond_to?(:read_many)
+        (groups[vfs] ||= []) << path
+      end
+
+      added = []
+      groups.each_pair do |vfs, paths|
+        data = vfs.read_many(paths)
+        next unless data
+        cache = (PREFETCH[vfs] ||= {})
+        paths.each_with_index do |path, i|
+          d = data.kind_of?(Hash) ? data[path] : data[i]
+          next unless d
+          cache[path] = d
+          added << [vfs, path]
+        end
+      end
+
+      added
+    end
+
+    def Central.forget_prefetch(entries)
+      entries.each do |(key, path)|
+        next unless cache = PREFETCH[key]
+        cache.delete(path)
+        PREFETCH.delete(key) if cache.empty?
+      end
+
+      nil
+    end
+
+    def Central.predlopen(features)
+      count = 0
+      deep_each(features) do |f|
+        f = f.to_str
+        next if provided?(f)
+        $:.each do |vfs|
+          (kind, path) = resolve(vfs, f)
+          next unless kind
+          count += 1 if kind == :so && predlopen_entry(vfs, path)
+          break
+        end
+      end
+      count
+    end
+
+    #
+    # 先行読み込みはファイルシステム上の共有オブジェクトに限られる。
+    #
+    def Central.predlopen_entry(vfs, path)
+      case vfs
+      when String
+        dir = vfs
+      when SystemVFS
+        dir = vfs.basedir
+      else
+        return false
+      end
+
+      sig = make_signature(vfs, path)
+      return false if $".include?(sig)
+      predlopen_start(dir, path, sig)
+    end
+
     def Central.find_rbfile(vfs, feature)
-      return feature if feature = Central.find_file(vfs, feature, ".rb")
+      return feature if feature = Central.find_file(vfs, feature, ".rb", ZEXT)
     end
 
     def Central.find_mrbfile(vfs, feature)
-      return feature if feature = Central.find_file(vfs, feature, ".mrb")
+      return feature if feature = Central.find_file(vfs, feature, ".mrb", ZEXT)
     end
 
     def Central.find_sofile(vfs, feature)
@@ -77,22 +510,64 @@ module RequirePlus
       signature = make_signature(vfs, feature)
       #p [__method__, __LINE__, vfs, signature]
       if $".include? signature
+        @last_signature = signature
+        false
+      elsif (ident = file_identity(vfs, feature)) &&
+            (loaded = IDENTITIES[ident]) && $".include?(loaded)
+        # 別の経路 (別のロードパスやシンボリックリンク) から同じファイルが読み込み済み
+        @last_signature = loaded
         false
       else
         #puts "#{__FILE__}(#{__LINE__})#{__method__}" => [vfs, feature]
-        yield signature
+        if RequirePlus.profile
+          Graph.enter(signature)
+          begin
+            yield signature
+          ensure
+            Graph.leave
+          end
+        else
+          yield signature
+        end
         #puts "#{__FILE__}(#{__LINE__})#{__method__}" => [vfs, feature]
         $" << signature
+        IDENTITIES[ident] = signature if ident
+        hook_after_load(signature) if hooked?
+        @last_signature = signature # 入れ子の require によって上書きされないように、最後に設定する
         true
       end
     end
 
+    IDENTITIES = {} unless const_defined?(:IDENTITIES)
+
+    #
+    # ファイルの実体を識別するための値を返す。識別できなければ nil を返す。
+    #
+    # ファイルシステムであればデバイス番号と i-node 番号から作られる。
+    # 利用者定義の VFS は `.identity(path)` を持つ場合に、その戻り値が用いられる。
+    #
+    def Central.file_identity(vfs, path)
+      case vfs
+      when String
+        sysfile_identity(vfs, path)
+      when SystemVFS
+        sysfile_identity(vfs.basedir, path)
+      else
+        if vfs.respond_to?(:identity) && (ident = vfs.identity(path))
+          [:vfs, ident]
+        else
+          nil
+        end
+      end
+    end
+
     def Central.load_as_rb(vfs, rb)
+      flags = compile_flags(vfs)
       vfs = SystemVFS.new(vfs) if vfs.kind_of?(String)
 
       load_common(vfs, rb) do |sig|
         #puts "#{__FILE__}(#{__LINE__})#{__method__}" => [vfs, sig]
-        compile_from_rb(vfs, rb, sig, vfs.read(rb))
+        compile_from_rb(vfs, rb, sig, read_file(vfs, rb), flags)
       end
     end
 
@@ -101,7 +576,7 @@ module RequirePlus
 
       load_common(vfs, mrb) do |sig|
         #puts "#{__FILE__}(#{__LINE__})#{__method__}" => [vfs, sig]
-        load_from_mrb(vfs, mrb, sig, vfs.read(mrb))
+        load_from_mrb(vfs, mrb, sig, read_file(vfs, mrb))
       end
     end
 
@@ -112,17 +587,110 @@ module RequirePlus
         #if vfs.respond_to?(:load_shared_object)
         #  vfs.load_shared_object(so, sig)
         #else
-          load_shared_object(vfs, so, sig, vfs.read(so))
+          load_shared_object(vfs, so, sig, read_file(vfs, so))
         #end
       end
     end
 
+    LOAD_CACHE = {} unless const_defined?(:LOAD_CACHE)
+
+    #
+    # `Kernel#load` の実体。
+    #
+    # 絶対パスであればそのまま、そうでなければ現在の作業ディレクトリ、ロードパスの順に探す。
+    # コンパイルした結果は絶対パスにしたシグネチャごとに保持され、ファイルの大きさと更新時刻、実体が変わらなければ
+    # 構文解析を省いて再実行する。
+    #
+    def Central.load_file(file)
+      sysdir_refresh
+      (kind, vfs) = load_location(file)
+      raise LoadError, "cannot load such file - #{file}" unless kind
+
+      flags = (kind == :rb ? compile_flags(vfs) : 0)
+      # 相対パスのシグネチャは作業ディレクトリが変わると別のファイルを指すため、絶対パスで保持する
+      key = cache_key(vfs, file)
+      vfs = SystemVFS.new(vfs) if vfs.kind_of?(String)
+      sig = make_signature(vfs, file)
+      stamp = key && file_stamp(vfs, file)
+
+      entry = LOAD_CACHE[key]
+      unless entry && stamp && entry[0] == stamp
+        data = read_file(vfs, file)
+        raise LoadError, "cannot load such file - #{file}" unless data
+        if kind == :rb
+          proc = compile_rb(vfs, file, sig, data, flags)
+        else
+          proc = load_mrb(vfs, file, sig, data)
+        end
+
+        # .mrb の irep が読み込んだバッファを参照する場合があるため、一緒に保持する
+        entry = [stamp, proc, data]
+        if stamp
+          LOAD_CACHE[key] = entry
+        else
+          LOAD_CACHE.delete(key)
+        end
+      end
+
+      exec_on_toplevel(entry[1])
+      true
+    end
+
+    #
+    # `load` が `file` を読み込む場所を `[kind, vfs]` として返す。見つからなければ nil を返す。
+    #
+    def Central.load_location(file)
+      case
+      when extname?(file, ".rb"), extname?(file, ".rb" + ZEXT)
+        kind = :rb
+      when extname?(file, ".mrb"), extname?(file, ".mrb" + ZEXT)
+        kind = :mrb
+      else
+        return nil
+      end
+
+      if file.start_with?("/")
+        vfs = "/"
+      elsif file?(".", file)
+        vfs = "."
+      else
+        vfs = $:.find { |e| file?(e, file) }
+        return nil unless vfs
+      end
+
+      [kind, vfs]
+    end
+
+    #
+    # LOAD_CACHE のキーを返す。作業ディレクトリが取得できなければ nil を返す (結果は再利用されない)。
+    #
+    def Central.cache_key(vfs, path)
+      if !vfs.kind_of?(String) || vfs.start_with?("/")
+        make_signature(vfs, path)
+      elsif cwd = getcwd
+        makepath(cwd, make_signature(vfs, path))
+      else
+        nil
+      end
+    end
+
+    #
+    # ファイルが変更されたかどうかを確認するための値を返す。
+    # 利用者定義の VFS は `.mtime` を持つ場合にのみ対応し、そうでなければ nil を返す (結果は再利用されない)。
+    #
+    def Central.file_stamp(vfs, path)
+      case vfs
+      when SystemVFS
+        sysfile_stamp(vfs.basedir, path)
+      else
+        vfs.respond_to?(:mtime) ? [vfs.size(path), vfs.mtime(path)] : nil
+      end
+    end
+
     def Central.findvfs(file)
-      $:.each do |vfs|
-        prefix = make_prefix(vfs)
-        prefix << "/"
+      loadpath_snapshot.each do |(vfs, prefix)|
         #p [__FILE__, __LINE__, prefix, file]
-        if file[prefix]
+        if file.start_with?(prefix)
           subpath = file[prefix.size..-1]
           if Central.file?(vfs, subpath)
             return [vfs, Central.dirname(subpath)]
@@ -133,26 +701,48 @@ module RequirePlus
       raise LoadError, "cannot infer basepath"
     end
 
-    def Central.find_file(vfs, file, exts)
-      if vfs.kind_of?(String)
-        vfs = SystemVFS.new(vfs)
+    #
+    # `zext` を与えた場合、`file + ext` が見つからなければ圧縮された `file + ext + zext` も探す。
+    #
+    def Central.find_file(vfs, file, exts, zext = nil)
+      case vfs
+      when String
+        return find_sysfile(vfs, file, exts, zext)
+      when SystemVFS
+        return find_sysfile(vfs.basedir, file, exts, zext)
       end
 
       deep_each(exts) do |ext|
-        return file if extname(file) == ext &&
-                       vfs.file?(file) &&
-                       vfs.size(file) < RequirePlus.loadsize_max
+        next unless extname?(file, ext)
+        return file if loadable?(vfs, file)
+        return file + zext if zext && loadable?(vfs, file + zext)
       end
 
       deep_each(exts) do |ext|
         t = file + ext
-        return t if vfs.file?(t) &&
-                    vfs.size(t) < RequirePlus.loadsize_max
+        return t if loadable?(vfs, t)
+        return t + zext if zext && loadable?(vfs, t + zext)
       end
 
       nil
     end
 
+    def Central.loadable?(vfs, path)
+      vfs.file?(path) && vfs.size(path) < RequirePlus.loadsize_max
+    end
+
+    #
+    # 圧縮されたファイルであれば展開して返す。
+    #
+    def Central.read_file(vfs, path)
+      cache = PREFETCH[vfs.kind_of?(SystemVFS) ? vfs.basedir : vfs] unless PREFETCH.empty?
+      data = cache && cache.delete(path)
+      data ||= vfs.read(path)
+      data = inflate(path, data) if path.end_with?(ZEXT)
+      Graph.add_bytes(data.bytesize) if data
+      data
+    end
+
     def Central.file?(vfs, subpath)
       case vfs
       when nil, ""
@@ -160,12 +750,12 @@ module RequirePlus
       when String
         ;
       when SystemVFS
-        vfs = vfs.basepath
+        vfs = vfs.basedir
       else
         return vfs.file?(subpath)
       end
 
-      File.file? makepath(vfs, subpath)
+      !sysfile_size(vfs, subpath).nil?
     end
 
     def Central.make_prefix(vfs)
@@ -181,8 +771,321 @@ module RequirePlus
       end
     end
 
+    #
+    # 圧縮されたファイルは `.z` を除いたシグネチャとなり、圧縮していないファイルと同じものとして扱われる。
+    #
     def Central.make_signature(vfs, path)
-      makepath(make_prefix(vfs), path)
+      path = path.chomp(ZEXT)
+      case vfs
+      when nil, ""
+        raise "wrong load path - #{vfs.inspect}"
+      when String
+        makepath(vfs, path)
+      when SystemVFS
+        makepath(vfs.basedir, path)
+      else
+        makepath("VFS:#<#{vfs.to_path}>", path)
+      end
+    end
+
+    MISSING = {} unless const_defined?(:MISSING)
+
+    def Central.try_require(feature)
+      feature = feature.to_str
+      return false if provided?(feature)
+
+      sysdir_refresh
+      generation = loadpath_generation
+      unless @missing_generation == generation
+        MISSING.clear
+        @missing_generation = generation
+      end
+      return nil if MISSING[feature]
+
+      if hooked?
+        ret = hooked_require(feature, $:, feature, nil)
+        unless ret.nil?
+          index_feature(feature)
+          return ret
+        end
+      else
+        $:.each do |vfs|
+          ret = trial_require(vfs, feature)
+          unless ret.nil?
+            index_feature(feature)
+            return ret
+          end
+        end
+      end
+
+      MISSING[feature] = true
+      nil
+    end
+
+    def Central.require_async(feature)
+      feature = feature.to_str
+      generation = loadpath_generation
+      return AsyncRequire.new(feature, generation, nil, nil) if provided?(feature)
+      sysdir_refresh
+      hook_before_resolve(feature) if hooked?
+
+      $:.each do |vfs|
+        (kind, path) = resolve(vfs, feature)
+        next unless kind
+        hook_after_resolve(feature, make_signature(vfs, path)) if hooked?
+
+        case vfs
+        when String
+          dir = vfs
+        when SystemVFS
+          dir = vfs.basedir
+        else
+          dir = nil
+        end
+
+        if dir
+          if kind == :so
+            # 先行読み込みの作業スレッドが読み込むため、ここでは読み込まない
+            predlopen_entry(vfs, path)
+          else
+            reader = async_read_start(dir, path)
+          end
+        end
+
+        return AsyncRequire.new(feature, generation, [vfs, kind, path], reader)
+      end
+
+      hook_after_resolve(feature, nil) if hooked?
+      raise LoadError, "cannot load such file - #{feature}"
+    rescue Exception => e
+      report_failure(feature, e)
+      raise
+    end
+
+    #
+    # `RequirePlus::AsyncRequire#value` から呼ばれ、mruby のスレッドで読み込みを完了させる。
+    #
+    # 読み込みを始めてからロードパスが変更された場合は、改めて `require` する。
+    #
+    def Central.finish_async(feature, generation, entry, reader)
+      data = reader.take if reader
+      return false if entry.nil? || provided?(feature)
+      return require(feature) unless loadpath_generation == generation
+
+      (vfs, kind, path) = entry
+      if data
+        key = vfs.kind_of?(SystemVFS) ? vfs.basedir : vfs
+        (PREFETCH[key] ||= {})[path] = data
+      end
+
+      begin
+        ret = load_resolved(vfs, kind, path)
+      rescue Exception => e
+        report_failure(feature, e)
+        raise
+      end
+      index_feature(feature)
+      ret
+    ensure
+      forget_prefetch([[key, path]]) if key
+    end
+
+    def Central.unload(feature)
+      feature = feature.to_str
+      sig = $".include?(feature) ? feature : loaded_signature(feature)
+      return forget_loaded_file(feature) unless sig
+
+      $".delete(sig)
+      FEATURE_INDEX.delete_if { |f, s| s == sig }
+      IDENTITIES.delete_if { |id, s| s == sig }
+      memory_table.delete(sig)
+      Graph.remove(sig)
+      @last_signature = nil if @last_signature == sig
+      unload_shared_object(sig)
+
+      true
+    end
+
+    #
+    # `load` によって LOAD_CACHE に保持されている `file` の手続きを手放す。保持されていなければ false を返す。
+    #
+    def Central.forget_loaded_file(file)
+      (kind, vfs) = load_location(file)
+      key = kind && cache_key(vfs, file)
+      return false unless key && LOAD_CACHE.key?(key)
+      LOAD_CACHE.delete(key)
+      true
+    end
+
+    #
+    # `feature` を `require` した時に読み込まれたシグネチャを返す。読み込まれていなければ nil を返す。
+    #
+    def Central.loaded_signature(feature)
+      if provided?(feature)
+        return FEATURE_INDEX[feature]
+      end
+
+      $:.each do |vfs|
+        (kind, path) = resolve(vfs, feature)
+        next unless kind
+        sig = make_signature(vfs, path)
+        return $".include?(sig) ? sig : nil
+      end
+
+      nil
+    end
+
+    FEATURE_INDEX = {} unless const_defined?(:FEATURE_INDEX)
+
+    #
+    # 一度 `require` に成功した feature 名から、読み込まれたシグネチャを引くための索引。
+    #
+    # ロードパスが変更されると索引は破棄される。
+    # 索引に当たった場合は探索を行わないため、文字列オブジェクトを一切確保しない。
+    #
+    def Central.provided?(feature)
+      return false if FEATURE_INDEX.empty?
+
+      unless loadpath_generation == @index_generation
+        FEATURE_INDEX.clear
+        return false
+      end
+
+      sig = FEATURE_INDEX[feature]
+      !!(sig && loaded?(sig))
+    end
+
+    def Central.index_feature(feature)
+      return unless @last_signature
+      @index_generation = loadpath_generation if FEATURE_INDEX.empty?
+      FEATURE_INDEX[feature] = @last_signature
+      @last_signature = nil
+    end
+
+    #
+    # Central.loadpath_generation (C で実装) はロードパスの世代番号を返す。
+    #
+    # `$:` を変更するメソッドが呼ばれるたびに増加する。`$:` そのものが別のオブジェクトに置き換えられた場合や、
+    # 要素数・要素の同一性が前回と異なる場合 (C からの変更や別名を通した変更) も増加する。
+    # ロードパスに依存する結果は、この値が変わらない間は再利用できる。
+    #
+
+    #
+    # 世代番号が一巡した時に C から呼ばれる。以前の世代番号と一致しないように、記録している世代番号を捨てる。
+    #
+    def Central.loadpath_wrapped
+      @index_generation = @missing_generation = @snapshot_generation = nil
+      FEATURE_INDEX.clear
+      MISSING.clear
+      nil
+    end
+
+    #
+    # ロードパスの各要素とその接頭辞 (シグネチャの先頭部分) の組を、世代ごとに作り直して返す。
+    #
+    def Central.loadpath_snapshot
+      gen = loadpath_generation
+      unless @snapshot && @snapshot_generation == gen
+        @snapshot = $:.map { |vfs| [vfs, make_prefix(vfs).__add_pathsep.freeze].freeze }.freeze
+        @snapshot_generation = gen
+      end
+
+      @snapshot
+    end
+
+    AUTOLOAD = {} unless const_defined?(:AUTOLOAD)
+
+    #
+    # 定数の完全な名前 (`"Foo::Bar"` の形式) をキーとして、読み込むべき feature を保持する。
+    #
+    # `const` に `"Foo::Bar"` を与えた場合、`Foo` がまだ定義されていなくても登録できる。
+    #
+    def Central.autoload_regist(mod, const, feature)
+      feature = feature.to_str
+      raise ArgumentError, "empty feature name" if feature.empty?
+      path = autoload_path(mod, const)
+      raise ArgumentError, "autoload for anonymous module - #{mod.inspect}" unless path
+      AUTOLOAD[path] = feature
+    end
+
+    def Central.autoload_feature(mod, const)
+      path = autoload_path(mod, const)
+      path ? AUTOLOAD[path] : nil
+    end
+
+    def Central.autoload_path(mod, const)
+      if mod.equal?(Object)
+        const.to_s
+      elsif name = mod.name
+        "#{name}::#{const}"
+      else
+        nil
+      end
+    end
+
+    #
+    # `mod` と、その名前から辿れる外側の名前空間を内側から順に探す。
+    # 最後に `Object` を探す。
+    #
+    # mruby は `module Foo` の中に書かれた `Bar` に対しても `Foo.const_missing(:Bar)` を呼ぶため、
+    # `Foo::Bar` との区別は付かない。最上位の `Bar` を参照するコードのために、最上位の登録まで辿る。
+    #
+    def Central.autoload_const(mod, const)
+      return yield if AUTOLOAD.empty?
+
+      scope = mod.name
+      scope = nil if mod.equal?(Object)
+      while true
+        path = scope ? "#{scope}::#{const}" : const.to_s
+        if feature = AUTOLOAD.delete(path)
+          begin
+            require feature
+          rescue Exception
+            AUTOLOAD[path] = feature
+            raise
+          end
+
+          owner = autoload_owner(scope)
+          return owner.const_get(const) if owner && owner.const_defined?(const)
+        end
+
+        break unless scope
+        sep = scope.rindex("::")
+        scope = sep ? scope[0, sep] : nil
+      end
+
+      yield
+    end
+
+    def Central.autoload_owner(scope)
+      return Object unless scope
+
+      scope.split("::").inject(Object) do |m, n|
+        return nil unless m.const_defined?(n.to_sym)
+        m.const_get(n.to_sym)
+      end
+    end
+
+    COMPILE_PROFILES = {} unless const_defined?(:COMPILE_PROFILES)
+
+    #
+    # ロードパスの要素 `vfs` に対するコンパイル設定を整数値として返す。
+    #
+    # `RequirePlus.set_compile_profile` による設定がなく、VFS オブジェクトが
+    # `.compile_profile` を持っていればその戻り値 (ハッシュ) を用いる。
+    #
+    def Central.compile_flags(vfs)
+      profile = COMPILE_PROFILES[vfs]
+      if profile.nil? && !vfs.kind_of?(String) && vfs.respond_to?(:compile_profile)
+        profile = vfs.compile_profile
+      end
+
+      return 0 unless profile
+
+      flags = 0
+      flags |= COMPILE_STRIP_DEBUG if profile[:debug] == false
+      flags |= COMPILE_NO_OPTIMIZE if profile[:optimize] == false
+      flags
     end
 
     def Central.deep_each(obj, &block)
@@ -209,15 +1112,15 @@ module RequirePlus
       const_set :BasicStruct, superclass
 
       def file?(path)
-        File.file? File.join(basedir, path)
+        !Central.sysfile_size(basedir, path).nil?
       end
 
       def size(path)
-        File.size File.join(basedir, path)
+        Central.sysfile_size(basedir, path)
       end
 
       def read(path)
-        File.open(File.join(basedir, path), "rb") { |f| f.read }
+        Central.sysfile_read(basedir, path)
       end
 
       def load_shared_object(so, sig)
@@ -227,6 +1130,45 @@ module RequirePlus
   end
 end
 
+module RequirePlus
+  #
+  # `$:` と `$LOAD_PATH` の実体となるクラスです。
+  #
+  # 変更を伴うメソッドが呼ばれると、変更した後にロードパスの世代番号が増加します。
+  # それ以外の経路による変更も、要素数と要素の同一性を比べることで次の `require` などの時に検出されます。
+  # 要素の文字列そのものを破壊的に変更した場合は検出できないため、要素を置き換えて下さい。
+  #
+  class LoadPath
+    def <<(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def []=(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def clear(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def collect!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def compact!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def concat(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def delete(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def delete_at(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def delete_if(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def fill(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def flatten!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def insert(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def keep_if(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def map!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def pop(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def push(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def reject!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def replace(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def reverse!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def rotate!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def select!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def shift(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def slice!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def sort!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def sort_by!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def uniq!(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+    def unshift(*args, &block); ret = super(*args, &block); Central.loadpath_changed; ret; end
+  end
+end
+
 module Kernel
   include RequirePlus::Kernel
 end
@@ -234,3 +1176,15 @@ end
 class Object
   include Kernel
 end
+
+class Module
+  include RequirePlus::Autoload
+
+  alias const_missing_without_autoload const_missing
+
+  def const_missing(const)
+    RequirePlus::Central.autoload_const(self, const) do
+      const_missing_without_autoload(const)
+    end
+  end
+end
@@ -0,0 +1,79 @@
+#include "internals.h"
+#include <string.h>
+
+/*
+ * 外部ライブラリに依存しない、LZ4 ブロック形式の展開処理。
+ *
+ * 展開先の大きさはあらかじめ分かっているため、全ての複写で範囲を確認する。
+ * 不正なデータに対しては偽を返すだけで、決して範囲外へ書き込まない。
+ */
+
+int64_t
+mruby_require_plus_zheader_size(const void *head, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)head;
+
+  if (len < MRUBY_REQUIRE_PLUS_ZHEADER_SIZE ||
+      memcmp(p, MRUBY_REQUIRE_PLUS_ZHEADER_MAGIC, 4) != 0) {
+    return -1;
+  }
+
+  return ((int64_t)p[4] << 24) |
+         ((int64_t)p[5] << 16) |
+         ((int64_t)p[6] <<  8) |
+         ((int64_t)p[7] <<  0);
+}
+
+static mrb_bool
+read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+  if (*len != 15) { return TRUE; }
+
+  for (;;) {
+    if (*ip >= iend) { return FALSE; }
+    uint8_t b = *(*ip) ++;
+    *len += b;
+    if (b != 255) { return TRUE; }
+  }
+}
+
+mrb_bool
+mruby_require_plus_zdecode(const void *src, size_t srclen, void *dest, size_t destlen)
+{
+  const uint8_t *ip = (const uint8_t *)src;
+  const uint8_t *iend = ip + srclen;
+  uint8_t *op = (uint8_t *)dest;
+  uint8_t *oend = op + destlen;
+
+  while (ip < iend) {
+    uint8_t token = *ip ++;
+
+    size_t len = token >> 4;
+    if (!read_length(&ip, iend, &len)) { return FALSE; }
+    if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) { return FALSE; }
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    /* 最後のシーケンスはリテラルだけで終わる */
+    if (ip >= iend) { break; }
+
+    if (iend - ip < 2) { return FALSE; }
+    size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest)) { return FALSE; }
+
+    len = token & 0x0f;
+    if (!read_length(&ip, iend, &len)) { return FALSE; }
+    len += 4;
+    if (len > (size_t)(oend - op)) { return FALSE; }
+
+    /* 複写元と複写先が重なることがあるため、1 バイトずつ複写する */
+    const uint8_t *match = op - offset;
+    for (; len > 0; len --) {
+      *op ++ = *match ++;
+    }
+  }
+
+  return op == oend;
+}
@@ -13,6 +13,7 @@
 #include <mruby/error.h>
 #include <mruby-aux.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #if defined(MRB_INT16)
 # pragma message("動作環境として想定していない MRB_INT16 が定義されています。")
@@ -41,6 +42,23 @@
 # pragma message("Need ``MRB_USE_ETEXT_EDATA'' configuration in your build_config.rb")
 #endif
 
+/*
+ * 圧縮されたファイル (`*.rb.z` や `*.mrb.z`) の形式:
+ *
+ *      offset  size  content
+ *      0       4     "RP+Z"
+ *      4       4     展開後のバイト数 (big endian)
+ *      8       ...   LZ4 ブロック (フレームヘッダやチェックサムは含まない)
+ */
+#define MRUBY_REQUIRE_PLUS_ZHEADER_SIZE 8
+#define MRUBY_REQUIRE_PLUS_ZHEADER_MAGIC "RP+Z"
+
+/* ヘッダが正しければ展開後のバイト数を、そうでなければ -1 を返す */
+int64_t mruby_require_plus_zheader_size(const void *head, size_t len);
+
+/* `src` を展開して `dest` をちょうど埋めた場合に真を返す */
+mrb_bool mruby_require_plus_zdecode(const void *src, size_t srclen, void *dest, size_t destlen);
+
 #include "compat.h"
 
 #endif /* MRUBY_REQUIRE_PLUS_INTERNALS_H */
@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1 /* for O_PATH */
+#endif
+
 #include <mruby.h>
 #include <mruby/dump.h>
 #include <mruby/irep.h>
@@ -51,15 +55,19 @@ mrb_read_irep_buf(mrb_state *mrb, const void *buf, size_t bufsize)
 #include "internals.h"
 #include <mruby/compile.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <wchar.h>
 #include <mruby-aux/mobptr.h>
 #include <mruby/dump.h>
 #include <mruby/proc.h>
+#include <mruby/debug.h>
+#include <mruby/gc.h>
 #include <mruby-aux/component-name.h>
 
 #define LOG0() do { fprintf(stderr, "%s:%d:%s.\n", __FILE__, __LINE__, __func__); } while (0)
@@ -91,7 +99,39 @@ mrb_read_irep_buf(mrb_state *mrb, const void *buf, size_t bufsize)
 # define HAVE_FDLOPEN 1
 #endif
 
+#if !(defined(_WIN32) && !defined(__CYGWIN__)) && !defined(HAVE_PTHREAD) && !defined(WITHOUT_PTHREAD)
+# define HAVE_PTHREAD 1
+# include <pthread.h>
+#endif
+
+#if defined(__GLIBC__) && !defined(HAVE_MALLOC_TRIM) && !defined(WITHOUT_MALLOC_TRIM)
+# define HAVE_MALLOC_TRIM 1
+# include <malloc.h>
+#endif
+
+#if defined(__GLIBC__) && !defined(HAVE_MALLOC_USABLE_SIZE) && !defined(WITHOUT_MALLOC_USABLE_SIZE)
+# define HAVE_MALLOC_USABLE_SIZE 1
+# include <malloc.h>
+#elif defined(__FreeBSD__) && !defined(HAVE_MALLOC_USABLE_SIZE) && !defined(WITHOUT_MALLOC_USABLE_SIZE)
+# define HAVE_MALLOC_USABLE_SIZE 1
+# include <malloc_np.h>
+#endif
+
+#if !defined(_WIN32) && !defined(HAVE_GETRUSAGE) && !defined(WITHOUT_GETRUSAGE)
+# define HAVE_GETRUSAGE 1
+# include <sys/resource.h>
+#endif
+
+#if !defined(_WIN32) && !defined(HAVE_MMAP) && !defined(WITHOUT_MMAP)
+# define HAVE_MMAP 1
+# include <sys/mman.h>
+# if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
+#endif
+
 static void make_funcname(MRB, VALUE str, const char name[]);
+static int sysdir_dup(MRB, VALUE dir, VALUE path, char *buf, size_t bufsize);
 
 static void
 aux_str_add_pathsep(MRB, VALUE str)
@@ -113,19 +153,15 @@ aux_add_pathsep(char *str, size_t len)
 static void
 make_funcname(MRB, VALUE str, const char name[])
 {
-  RSTR_SET_LEN(mrb_str_ptr(str), 0);
-  mrb_str_cat_cstr(mrb, str, TOKEN2STR(MRUBY_REQUIRE_PLUS_COMMON_PREFIX));
+  static const char prefix[] = TOKEN2STR(MRUBY_REQUIRE_PLUS_COMMON_PREFIX);
 
-  const char *p = name;
-  for (; *p != '\0'; p ++) {
-    char ch;
-    if (isalnum(*p)) {
-      ch = *p;
-    } else {
-      ch = '_';
-    }
+  mrb_str_resize(mrb, str, sizeof(prefix) - 1 + strlen(name));
+  char *p = RSTRING_PTR(str);
+  memcpy(p, prefix, sizeof(prefix) - 1);
+  p += sizeof(prefix) - 1;
 
-    mrb_str_cat(mrb, str, &ch, 1);
+  for (; *name != '\0'; name ++, p ++) {
+    *p = (isalnum((unsigned char)*name) ? *name : '_');
   }
 }
 
@@ -153,6 +189,14 @@ make_irepname(MRB, VALUE str, const char name[])
   return RSTRING_PTR(str);
 }
 
+static const char *
+make_descname(MRB, VALUE str, const char name[])
+{
+  make_funcname(mrb, str, name);
+  mrb_str_cat_cstr(mrb, str, TOKEN2STR(MRUBY_REQUIRE_PLUS_DESCRIPTOR_SUFFIX));
+  return RSTRING_PTR(str);
+}
+
 #ifdef MRUBY_REQUIRE_PLUS_WITHOUT_SO
 #else
 #endif
@@ -206,7 +250,6 @@ struct loadso_spec;
 typedef void mruby_require_plus_init_f(mrb_state *mrb);
 typedef void mruby_require_plus_final_f(mrb_state *mrb);
 
-static void unload_shared_object(MRB, struct loadso_spec *p);
 static mrb_value compile_from_rb(MRB, VALUE self);
 static mrb_value load_from_mrb(MRB, VALUE self);
 static mrb_value load_shared_object(MRB, VALUE self);
@@ -221,7 +264,27 @@ struct loadso_spec
 {
   struct loadso_spec *next;
   void *linkage;
+  mruby_require_plus_init_f *init;
   mruby_require_plus_final_f *final;
+  const void *irep;
+
+  /*
+   * 同じ内容の共有オブジェクトを二重に書き出して dlopen() しないためのバイナリの要約値と複製。
+   * 要約値は衝突しうるため、一致した場合は複製と突き合わせる。複製はハンドルの所有者だけが持つ。
+   * borrowed が真であれば linkage は他の要素から借りているので dlclose() しない。
+   */
+  uint64_t digest;
+  void *bin;
+  size_t binsize;
+  bool borrowed;
+
+  /*
+   * unloadable が真であれば、RequirePlus.unload で dlclose() してもよい (記述子の MRUBY_REQUIRE_PLUS_UNLOADABLE)。
+   * 偽のまま unload された要素は、初期化関数などを NULL にし、ハンドルを保持するためだけに一覧に残す。
+   */
+  bool unloadable;
+
+  char *signature; /* RequirePlus.unload のため */
 };
 
 static VALUE
@@ -243,9 +306,11 @@ loadso_free(MRB, void *ptr)
       mrb_protect(mrb, loadso_free_trial, mrb_cptr_value(mrb, p), NULL);
       mrb_gc_arena_restore(mrb, ai);
     }
-    if (p->linkage) {
+    if (p->linkage && !p->borrowed) {
       dlclose(p->linkage);
     }
+    mrb_free(mrb, p->bin);
+    mrb_free(mrb, p->signature);
     mrb_free(mrb, p);
     p = next;
   }
@@ -253,7 +318,15 @@ loadso_free(MRB, void *ptr)
 
 static const mrb_data_type loaded_shared_object_type = { "so data@require+", loadso_free };
 
-static void unload_shared_object(MRB, struct loadso_spec *p);
+static void
+loadso_set_signature(MRB, struct loadso_spec *p, const char *signature)
+{
+  size_t len = strlen(signature);
+  char *s = (char *)mrb_malloc(mrb, len + 1);
+  memcpy(s, signature, len + 1);
+  mrb_free(mrb, p->signature);
+  p->signature = s;
+}
 
 static void
 parser_free(MRB, void *ptr)
@@ -353,530 +426,3480 @@ aux_exec_proc_on_toplevel(MRB, struct RProc *proc)
 #endif
 }
 
-static mrb_value
-compile_from_rb(MRB, VALUE self)
-{
-  mrb_value vfs, name;
-  const char *signature, *code;
-  mrb_int codesize;
-  mrb_get_args(mrb, "oSzs", &vfs, &name, &signature, &code, &codesize);
+/*
+ * 計測の有効・無効 (RequirePlus.profile)。
+ *
+ * 依存関係の記録のように、読み込みのたびに記録が増えていくものは、有効な場合にのみ行う。
+ */
+#define id_profile SYMBOL("profile@require+")
 
-  int ai = mrb_gc_arena_save(mrb);
-  mrb_value mob = mrbx_mob_create(mrb);
-  mrbc_context *cc = mrbc_context_new(mrb);
-  mrbc_filename(mrb, cc, signature);
-  mrbx_mob_push(mrb, mob, cc, (mrbx_mob_free_f *)mrbc_context_free);
-  struct mrb_parser_state *parser = mrb_parse_nstring(mrb, code, codesize, cc);
-  mrbx_mob_push(mrb, mob, parser, parser_free);
-  mrb_parser_set_filename(parser, signature);
-  struct RProc *proc = mrb_generate_code(mrb, parser);
-  mrbx_mob_cleanup(mrb, mob);
-  mrb_gc_arena_restore(mrb, ai);
-  mrb_gc_protect(mrb, VALUE(proc));
+static bool
+profile_p(MRB)
+{
+  return mrb_test(mrb_gv_get(mrb, id_profile));
+}
 
-  aux_exec_proc_on_toplevel(mrb, proc);
-  mrb_gc_arena_restore(mrb, ai);
+static VALUE
+rp_profile(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  return mrb_bool_value(profile_p(mrb));
+}
 
-  return Qnil;
+static VALUE
+rp_set_profile(MRB, VALUE self)
+{
+  mrb_bool enable;
+  mrb_get_args(mrb, "b", &enable);
+  mrb_gv_set(mrb, id_profile, mrb_bool_value(enable));
+  return mrb_bool_value(enable);
 }
 
-static mrb_value
-load_from_mrb(MRB, VALUE self)
+#if MRUBY_RELEASE_NO < 10300
+# define AUX_GC_DISABLED(MRB) ((MRB)->gc_disabled)
+#else
+# define AUX_GC_DISABLED(MRB) ((MRB)->gc.disabled)
+#endif
+
+/*
+ * 構文解析とコード生成の間に確保されたメモリ量を計測する。
+ *
+ * 一時領域そのものは、構文解析器とコード生成器がそれぞれ持つ mrb_pool (一括解放されるアリーナ) に確保され、
+ * mrb_parser_free() とコード生成の終わりにまとめて解放される (test/loader_memory.rb で確かめている)。
+ * ここでは mrb->allocf を一時的に差し替えて、その間の確保量の最大値と、残った量 (irep など) を記録する。
+ * 無関係なオブジェクトの解放が差し引かれないように、計測の間は GC を止める。
+ *
+ * 既定のメモリ確保関数が使われていて malloc_usable_size() が利用可能な場合にのみ有効となる。
+ */
+struct loader_memory
 {
-  mrb_value vfs, name;
-  const char *signature;
-  const uint8_t *bin;
-  mrb_int binsize;
-  mrb_get_args(mrb, "oSzs", &vfs, &name, &signature, &bin, &binsize);
+  int64_t last_peak;    /* 直前のコンパイルにおける一時領域を含めた最大確保量 */
+  int64_t last_retain;  /* 直前のコンパイルの後に残った確保量 */
+  int64_t last_rss;     /* 直前のコンパイルによって増えたプロセスの最大 RSS */
+  int64_t max_peak;     /* これまでの last_peak の最大値 */
+  int64_t total_retain; /* これまでの last_retain の合計 */
+  int64_t compiles;
+};
 
-  int ai = mrb_gc_arena_save(mrb);
-  mrb_value mob = mrbx_mob_create(mrb);
-  check_mruby_binary(mrb, bin, binsize, name);
-  mrb_irep *irep = mrb_read_irep_buf(mrb, bin, binsize);
-  if (irep == NULL) {
-    mrb_raisef(mrb, E_LOAD_ERROR, "load error - %S", name);
-  }
-  mrbx_mob_push(mrb, mob, irep, (mrbx_mob_free_f *)mrb_irep_decref);
-  struct RProc *proc = mrb_proc_new(mrb, irep);
-  mrbx_mob_pop(mrb, mob, irep);
-  mrbx_mob_cleanup(mrb, mob);
-  mrb_gc_arena_restore(mrb, ai);
-  mrb_gc_protect(mrb, VALUE(proc));
+static const mrb_data_type loader_memory_type = { "loader memory@require+", mrb_free };
 
-  aux_exec_proc_on_toplevel(mrb, proc);
-  mrb_gc_arena_restore(mrb, ai);
+#define id_loader_memory SYMBOL("loader memory@require+")
 
-  return Qnil;
+struct loader_meter
+{
+  struct loader_meter *parent; /* 入れ子になった計測の外側 */
+  mrb_allocf allocf;
+  void *allocf_ud;
+  int64_t current;
+  int64_t peak;
+  int64_t rss;
+  bool active;
+  bool stop_gc;
+  bool gc_disabled;            /* 計測を始める前の状態 */
+};
+
+/*
+ * プロセスの最大 RSS (バイト単位) を返す。取得できなければ 0 を返す。
+ */
+static int64_t
+peak_rss(void)
+{
+#ifdef HAVE_GETRUSAGE
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) { return 0; }
+# ifdef __APPLE__
+  return (int64_t)ru.ru_maxrss;
+# else
+  return (int64_t)ru.ru_maxrss * 1024;
+# endif
+#else
+  return 0;
+#endif
 }
 
-static struct loadso_spec *
-prepare_linkage(MRB)
+#ifdef HAVE_MALLOC_USABLE_SIZE
+static void *
+loader_meter_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
 {
-  mrb_value loadedso = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
-  mrb_data_check_type(mrb, loadedso, &loaded_shared_object_type);
-  struct loadso_spec *p = (struct loadso_spec *)DATA_PTR(loadedso);
+  struct loader_meter *m = (struct loader_meter *)ud;
+  size_t oldsize = (p ? malloc_usable_size(p) : 0);
+  void *q = m->allocf(mrb, p, size, m->allocf_ud);
+
+  if (size == 0) {
+    m->current -= oldsize;
+  } else if (q) {
+    m->current += (int64_t)malloc_usable_size(q) - (int64_t)oldsize;
+    if (m->current > m->peak) { m->peak = m->current; }
+  }
 
-  /*
-   * 最初にロードする時か、以前ロードを試みて成功した時に新しい領域を確保する。
-   * 以前失敗した場合は NULL で埋めてあるだけなので、再利用する。
-   */
-  if (p == NULL || p->linkage != NULL) {
-    struct loadso_spec *o = (struct loadso_spec *)mrb_calloc(mrb, 1, sizeof(struct loadso_spec));
-    o->next = p;
-    DATA_PTR(loadedso) = p = o;
+  return q;
+}
+#endif
+
+/*
+ * 計測を始める。`stop_gc` が真であれば、計測を終えるまで GC を止める。
+ */
+static void
+loader_meter_begin(MRB, struct loader_meter *m, bool stop_gc)
+{
+  memset(m, 0, sizeof(*m));
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+  if (mrb->allocf == loader_meter_allocf) {
+    /* 入れ子の require による計測。外側の計測にも数えられるように連鎖させる */
+    m->parent = (struct loader_meter *)mrb->allocf_ud;
   }
+  if (mrb->allocf == mrb_default_allocf || m->parent) {
+    m->allocf = mrb->allocf;
+    m->allocf_ud = mrb->allocf_ud;
+    m->active = true;
+    m->stop_gc = stop_gc;
+    m->gc_disabled = AUX_GC_DISABLED(mrb);
+    m->rss = peak_rss();
+    if (stop_gc) { AUX_GC_DISABLED(mrb) = TRUE; }
+    mrb->allocf = loader_meter_allocf;
+    mrb->allocf_ud = m;
+  }
+#endif
+}
 
-  return p;
+/*
+ * 計測を終える。
+ * 確保は連鎖した全ての計測に数えられているため、残った量は外側の全ての計測から差し引かれ、
+ * 入れ子の feature の分として扱われる。
+ */
+static bool
+loader_meter_stop(MRB, struct loader_meter *m)
+{
+  if (!m->active) { return false; }
+
+  mrb->allocf = m->allocf;
+  mrb->allocf_ud = m->allocf_ud;
+  if (m->stop_gc) { AUX_GC_DISABLED(mrb) = m->gc_disabled; }
+  m->active = false;
+  m->rss = peak_rss() - m->rss;
+  struct loader_meter *q;
+  for (q = m->parent; q; q = q->parent) { q->current -= m->current; }
+
+  return true;
 }
 
-static void so_rmdir_and_free_heap(MRB, void *ptr) { rmdir((const char *)ptr); mrb_free(mrb, ptr); }
-static void so_file_delete_and_free_heap(MRB, void *ptr) { unlink((const char *)ptr); mrb_free(mrb, ptr); }
-static void so_fd_close(MRB, void *ptr) { close((int)(uintptr_t)ptr); }
-static void so_dl_close(MRB, void *ptr) { dlclose(ptr); }
+static void
+loader_meter_end(MRB, struct loader_meter *m)
+{
+  if (!loader_meter_stop(mrb, m)) { return; }
+
+  struct loader_memory *lm = (struct loader_memory *)mrb_data_get_ptr(mrb, mrb_gv_get(mrb, id_loader_memory), &loader_memory_type);
+  if (lm == NULL) { return; }
+  lm->last_peak = m->peak;
+  lm->last_retain = m->current;
+  lm->last_rss = m->rss;
+  lm->max_peak = max(lm->max_peak, m->peak);
+  lm->total_retain += m->current;
+  lm->compiles ++;
+}
 
-static const char *
-make_tmpdir(MRB, VALUE mob)
+/*
+ * 読み込まれた feature ごとのメモリ使用量 (RequirePlus.memory_report)。
+ *
+ * シグネチャをキーとするハッシュで、値は項目名のシンボルをキーとするハッシュとなる。
+ *
+ * - irep - irep が占める量の合計 (iseq、pool、syms、debug とその他の構造体)
+ * - so - 共有オブジェクトのファイルの大きさ (マップされたページ数ではない)
+ * - heap - 最上位の実行 (と初期化関数) の前後で増えた量 (RequirePlus.profile が真で、malloc_usable_size() が利用可能な場合のみ)
+ */
+#define id_memory_report SYMBOL("memory report@require+")
+
+static void
+memory_report_add(MRB, const char *signature, mrb_sym key, int64_t value)
 {
-  /* template は C++ のキーワードなので…… */
-  static const char temprate[] = "mruby-require+XXXXXXXXXXXXXXXXXXXXXXXX";
-  const char *tmproot;
+  VALUE table = mrb_gv_get(mrb, id_memory_report);
+  if (!mrb_hash_p(table)) { return; }
 
-  if ((tmproot = getenv("MRUBY_REQUIRE_PLUS_TMPDIR")) == NULL &&
-      (tmproot = getenv("TMPDIR")) == NULL &&
-      (tmproot = getenv("TEMP")) == NULL &&
-      (tmproot = getenv("TMP")) == NULL) {
-    tmproot = "/tmp";
+  int ai = mrb_gc_arena_save(mrb);
+  VALUE sig = mrb_str_new_cstr(mrb, signature);
+  VALUE entry = mrb_hash_get(mrb, table, sig);
+  if (!mrb_hash_p(entry)) {
+    entry = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, table, sig, entry);
   }
+  VALUE old = mrb_hash_get(mrb, entry, mrb_symbol_value(key));
+  value += (mrb_fixnum_p(old) ? mrb_fixnum(old) : 0);
+  mrb_hash_set(mrb, entry, mrb_symbol_value(key), mrb_fixnum_value((mrb_int)value));
+  mrb_gc_arena_restore(mrb, ai);
+}
 
-  char *s = (char *)mrbx_mob_malloc(mrb, mob, strlen(tmproot) + strlen("/") + strlen(temprate) + 1);
-  s[0] = '\0';
-  strcat(s, tmproot);
-  aux_add_pathsep(s, strlen(s));
-  strcat(s, temprate);
-  mktemp(s);
-  if (mkdir(s, 0700) != 0) { return NULL; }
-  mrbx_mob_push(mrb, mob, s, so_rmdir_and_free_heap);
+struct irep_footprint
+{
+  int64_t iseq;
+  int64_t pool;
+  int64_t syms;
+  int64_t debug;
+  int64_t others;
+};
 
-  return s;
+static void
+irep_footprint(const mrb_irep *irep, struct irep_footprint *fp)
+{
+  int i;
+
+  fp->others += sizeof(mrb_irep) + sizeof(struct mrb_irep *) * irep->rlen;
+  if (irep->lv) { fp->others += sizeof(struct mrb_locals) * irep->nlocals; }
+  fp->iseq += sizeof(mrb_code) * irep->ilen;
+  fp->pool += sizeof(mrb_value) * irep->plen;
+  for (i = 0; i < irep->plen; i ++) {
+    if (mrb_string_p(irep->pool[i])) { fp->pool += RSTRING_LEN(irep->pool[i]) + 1; }
+  }
+  fp->syms += sizeof(mrb_sym) * irep->slen;
+
+  if (irep->debug_info) {
+    const mrb_irep_debug_info *d = irep->debug_info;
+    fp->debug += sizeof(*d) + sizeof(mrb_irep_debug_info_file *) * d->flen;
+    for (i = 0; i < d->flen; i ++) {
+      const mrb_irep_debug_info_file *f = d->files[i];
+      fp->debug += sizeof(*f);
+      switch (f->line_type) {
+      case mrb_debug_line_ary:
+        fp->debug += sizeof(uint16_t) * f->line_entry_count;
+        break;
+      case mrb_debug_line_flat_map:
+        fp->debug += sizeof(mrb_irep_debug_info_line) * f->line_entry_count;
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i < irep->rlen; i ++) {
+    irep_footprint(irep->reps[i], fp);
+  }
 }
 
-static const char *
-make_tmpname(MRB, VALUE mob, const char tmpdir[], const char name[])
+static void
+memory_report_irep(MRB, const char *signature, const struct RProc *proc)
 {
-  char *tmpname = (char *)mrbx_mob_malloc(mrb, mob, strlen(tmpdir) + strlen("/") + strlen(name) + 1);
+  if (MRB_PROC_CFUNC_P(proc) || proc->body.irep == NULL) { return; }
 
-  tmpname[0] = '\0';
-  strcat(tmpname, tmpdir);
-  strcat(tmpname, "/");
-  strcat(tmpname, name);
+  struct irep_footprint fp;
+  memset(&fp, 0, sizeof(fp));
+  irep_footprint(proc->body.irep, &fp);
 
-  return tmpname;
+  memory_report_add(mrb, signature, SYMBOL("irep"), fp.iseq + fp.pool + fp.syms + fp.debug + fp.others);
+  memory_report_add(mrb, signature, SYMBOL("iseq"), fp.iseq);
+  memory_report_add(mrb, signature, SYMBOL("pool"), fp.pool);
+  memory_report_add(mrb, signature, SYMBOL("syms"), fp.syms);
+  memory_report_add(mrb, signature, SYMBOL("debug"), fp.debug);
 }
 
-static void *
-masquerade_dlopen(MRB, VALUE mob, const char name[], const void *bin, size_t binsize)
+/*
+ * 初期化関数と最上位の手続きを実行し、RequirePlus.profile が真であればその間に増えた量を記録する。
+ *
+ * 無関係なオブジェクトの解放が差し引かれないように、計測を始める前に GC を完全に行う。
+ * また、実行中に不要となったオブジェクトが残った量に含まれないように、計測を終える前にも GC を完全に行う。
+ * 入れ子の feature の計測でも同じことを行うため、外側の計測が入れ子の GC によって歪むこともない。
+ */
+struct exec_metered
 {
-  const char *tmpdir = make_tmpdir(mrb, mob);
-  if (tmpdir == NULL) { return NULL; }
+  struct loader_meter meter;
+  const char *signature;
+  mruby_require_plus_init_f *init;
+  struct RProc *proc;
+};
 
-  const char *tmpname = make_tmpname(mrb, mob, tmpdir, name);
-  if (tmpname == NULL) { return NULL; }
+static VALUE
+exec_metered_trial(MRB, VALUE opaque)
+{
+  struct exec_metered *args = (struct exec_metered *)mrb_cptr(opaque);
 
-  enum {
-#ifdef HAVE_FDLOPEN
-    open_mode = O_RDWR | O_CREAT | O_TRUNC | O_EXCL | O_EXLOCK | O_NOFOLLOW | O_DIRECT
-#else
-    open_mode = O_WRONLY | O_CREAT | O_TRUNC | O_EXCL | O_EXLOCK | O_NOFOLLOW | O_DIRECT
-#endif
-  };
+  loader_meter_begin(mrb, &args->meter, false);
+  if (args->init) { args->init(mrb); }
+  if (args->proc) { aux_exec_proc_on_toplevel(mrb, args->proc); }
+  mrb_full_gc(mrb);
 
-  int fd = open(tmpname, open_mode, 0700);
-  if (fd == -1) { return NULL; }
-  mrbx_mob_push(mrb, mob, (void *)tmpname, so_file_delete_and_free_heap);
-  mrbx_mob_push(mrb, mob, (void *)(uintptr_t)fd, so_fd_close);
-  errno = 0;
+  return Qnil;
+}
 
-#ifdef HAVE_FDLOPEN
-  mrbx_mob_free(mrb, mob, (void *)tmpname);
-  if (write(fd, bin, binsize) != binsize) { return NULL; }
-  //fcntl(fd, F_SETFL, O_RDONLY | O_EXLOCK | O_NOFOLLOW);
-  void *handle = fdlopen(fd, RTLD_NOW);
-  mrbx_mob_free(mrb, mob, (void *)(uintptr_t)fd);
-#else
-  if (write(fd, bin, binsize) != binsize) { return NULL; }
-  mrbx_mob_free(mrb, mob, (void *)(uintptr_t)fd);
-  void *handle = dlopen(tmpname, RTLD_NOW);
-  mrbx_mob_free(mrb, mob, (void *)tmpname);
-#endif
+static VALUE
+exec_metered_cleanup(MRB, VALUE opaque)
+{
+  struct exec_metered *args = (struct exec_metered *)mrb_cptr(opaque);
 
-  if (handle) {
-    mrbx_mob_push(mrb, mob, handle, so_dl_close);
+  if (loader_meter_stop(mrb, &args->meter)) {
+    memory_report_add(mrb, args->signature, SYMBOL("heap"), args->meter.current);
   }
 
-  return handle;
+  return Qnil;
 }
 
-static mrb_value
-load_shared_object(MRB, VALUE self)
+static void
+exec_metered(MRB, const char *signature, mruby_require_plus_init_f *init, struct RProc *proc)
 {
-  mrb_value vfs, name;
-  const char *signature, *bin;
-  mrb_int binsize;
-  mrb_get_args(mrb, "oSzs", &vfs, &name, &signature, &bin, &binsize);
+  if (!profile_p(mrb)) {
+    if (init) { init(mrb); }
+    if (proc) { aux_exec_proc_on_toplevel(mrb, proc); }
+    return;
+  }
 
-  int ai = mrb_gc_arena_save(mrb);
-  VALUE mob = mrbx_mob_create(mrb);
+  mrb_full_gc(mrb);
 
-  mrb_str_strlen(mrb, mrb_str_ptr(name)); /* 途中に NUL が含まれていないことが保証される */
-  void *handle = masquerade_dlopen(mrb, mob, RSTRING_PTR(name), bin, binsize);
-  if (handle == NULL) { goto raise_exc; }
+  struct exec_metered args;
+  memset(&args, 0, sizeof(args));
+  args.signature = signature;
+  args.init = init;
+  args.proc = proc;
 
-  {
-    mrbx_component_name cn = mrbx_split_path(RSTRING_PTR(name), RSTRING_LEN(name));
-    VALUE base;
-    if (cn.nameterm - cn.extname == 3 && memcmp(cn.extname, ".so", 3) == 0) {
-      base = mrb_str_new(mrb, cn.basename, cn.extname - cn.basename);
-    } else {
-      base = mrb_str_new(mrb, cn.basename, cn.nameterm - cn.basename);
-    }
-    VALUE funcname = mrb_str_new(mrb, NULL, 0);
-    mruby_require_plus_init_f *init = (mruby_require_plus_init_f *)dlfunc(handle, make_initname(mrb, funcname, RSTRING_PTR(base)));
-    mruby_require_plus_final_f *final = (mruby_require_plus_init_f *)dlfunc(handle, make_finalname(mrb, funcname, RSTRING_PTR(base)));
-    const void *irepbin = dlsym(handle, make_irepname(mrb, funcname, RSTRING_PTR(base)));
+  VALUE argsv = mrb_cptr_value(mrb, &args);
+  mrb_ensure(mrb, exec_metered_trial, argsv, exec_metered_cleanup, argsv);
+}
 
-    if (init == NULL && irepbin == NULL) { goto raise_exc; }
+/*
+ * 利用者が登録する読み込み処理のフック (mruby_require_plus_set_hooks)。
+ *
+ * 登録されていなければ DATA_PTR は NULL となり、Ruby 側は Central.hooked? によって
+ * 通常の経路を通る。
+ */
+#define id_hooks SYMBOL("hooks@require+")
 
-    mrbx_mob_pop(mrb, mob, handle);
-    mrb_gc_arena_restore(mrb, ai);
-    mrb_gc_protect(mrb, mob);
+static const mrb_data_type hooks_type = { "hooks@require+", mrb_free };
+
+static const struct mruby_require_plus_hooks *
+get_hooks(MRB)
+{
+  return (const struct mruby_require_plus_hooks *)mrb_data_check_get_ptr(mrb, mrb_gv_get(mrb, id_hooks), &hooks_type);
+}
+
+MRB_API void
+mruby_require_plus_set_hooks(MRB, const struct mruby_require_plus_hooks *hooks)
+{
+  VALUE d = mrb_gv_get(mrb, id_hooks);
+  mrb_data_check_type(mrb, d, &hooks_type);
+
+  struct mruby_require_plus_hooks *p = NULL;
+  if (hooks) {
+    p = (struct mruby_require_plus_hooks *)mrb_malloc(mrb, sizeof(*p));
+    memcpy(p, hooks, sizeof(*p));
+  }
+
+  mrb_free(mrb, DATA_PTR(d));
+  DATA_PTR(d) = p;
+}
+
+static VALUE
+ext_hooked_p(MRB, VALUE self)
+{
+  return mrb_bool_value(get_hooks(mrb) != NULL);
+}
+
+static VALUE
+ext_hook_before_resolve(MRB, VALUE self)
+{
+  const char *feature;
+  mrb_get_args(mrb, "z", &feature);
+
+  const struct mruby_require_plus_hooks *hooks = get_hooks(mrb);
+  if (hooks && hooks->before_resolve) {
+    hooks->before_resolve(mrb, hooks->userdata, feature);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+ext_hook_after_resolve(MRB, VALUE self)
+{
+  const char *feature, *signature;
+  mrb_get_args(mrb, "zz!", &feature, &signature);
+
+  const struct mruby_require_plus_hooks *hooks = get_hooks(mrb);
+  if (hooks && hooks->after_resolve) {
+    hooks->after_resolve(mrb, hooks->userdata, feature, signature);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+ext_hook_after_load(MRB, VALUE self)
+{
+  const char *signature;
+  mrb_get_args(mrb, "z", &signature);
+
+  const struct mruby_require_plus_hooks *hooks = get_hooks(mrb);
+  if (hooks && hooks->after_load) {
+    hooks->after_load(mrb, hooks->userdata, signature);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+ext_hook_on_failure(MRB, VALUE self)
+{
+  const char *feature;
+  VALUE exc;
+  mrb_get_args(mrb, "zo", &feature, &exc);
+
+  const struct mruby_require_plus_hooks *hooks = get_hooks(mrb);
+  if (hooks && hooks->on_failure) {
+    hooks->on_failure(mrb, hooks->userdata, feature, exc);
+  }
+
+  return Qnil;
+}
+
+/*
+ * コンパイル設定 (ロードパスの要素や VFS ごとに指定される)
+ */
+enum {
+  COMPILE_STRIP_DEBUG = 1 << 0, /* ファイル名・行番号情報を生成しない */
+  COMPILE_NO_OPTIMIZE = 1 << 1, /* 覗き穴最適化を行わない */
+};
+
+struct compile_rb
+{
+  struct loader_meter meter;
+  mrb_int flags;
+  const char *signature;
+  const char *code;
+  mrb_int codesize;
+  struct RProc *proc;
+};
+
+static VALUE
+compile_rb_trial(MRB, VALUE opaque)
+{
+  struct compile_rb *args = (struct compile_rb *)mrb_cptr(opaque);
+
+  loader_meter_begin(mrb, &args->meter, true);
+
+  mrb_value mob = mrbx_mob_create(mrb);
+  mrbc_context *cc = mrbc_context_new(mrb);
+  bool debug = !(args->flags & COMPILE_STRIP_DEBUG);
+  if (debug) { mrbc_filename(mrb, cc, args->signature); }
+#if MRUBY_RELEASE_NO >= 10300
+  if (args->flags & COMPILE_NO_OPTIMIZE) { cc->no_optimize = TRUE; }
+#endif
+  mrbx_mob_push(mrb, mob, cc, (mrbx_mob_free_f *)mrbc_context_free);
+  struct mrb_parser_state *parser = mrb_parse_nstring(mrb, args->code, args->codesize, cc);
+  mrbx_mob_push(mrb, mob, parser, parser_free);
+  if (parser == NULL) {
+    mrb_raise(mrb, E_LOAD_ERROR, "failed allocation for parser");
+  }
+  if (parser->nerr > 0) {
+    mrb_raisef(mrb, E_SYNTAX_ERROR, "%S:%S: %S",
+               mrb_str_new_cstr(mrb, args->signature),
+               mrb_fixnum_value(parser->error_buffer[0].lineno),
+               mrb_str_new_cstr(mrb, parser->error_buffer[0].message));
+  }
+  if (debug) { mrb_parser_set_filename(parser, args->signature); }
+  args->proc = mrb_generate_code(mrb, parser);
+  if (args->proc == NULL) {
+    mrb_raisef(mrb, E_SCRIPT_ERROR, "codegen error - %S", mrb_str_new_cstr(mrb, args->signature));
+  }
+  mrbx_mob_cleanup(mrb, mob);
+
+  return Qnil;
+}
+
+static VALUE
+compile_rb_cleanup(MRB, VALUE opaque)
+{
+  struct compile_rb *args = (struct compile_rb *)mrb_cptr(opaque);
+  loader_meter_end(mrb, &args->meter);
+  return Qnil;
+}
+
+static struct RProc *
+compile_rb_proc(MRB, const char *signature, const char *code, mrb_int codesize, mrb_int flags)
+{
+  const struct mruby_require_plus_hooks *hooks = get_hooks(mrb);
+  if (hooks && hooks->before_compile) {
+    struct RProc *proc = hooks->before_compile(mrb, hooks->userdata, signature, code, (size_t)codesize);
+    if (proc) { return proc; }
+  }
+
+  struct compile_rb args;
+  memset(&args, 0, sizeof(args));
+  args.signature = signature;
+  args.code = code;
+  args.codesize = codesize;
+  args.flags = flags;
+
+  VALUE argsv = mrb_cptr_value(mrb, &args);
+  mrb_ensure(mrb, compile_rb_trial, argsv, compile_rb_cleanup, argsv);
+
+  return args.proc;
+}
+
+static struct RProc *
+load_mrb_proc(MRB, VALUE name, const uint8_t *bin, mrb_int binsize)
+{
+  mrb_value mob = mrbx_mob_create(mrb);
+  check_mruby_binary(mrb, bin, binsize, name);
+  mrb_irep *irep = mrb_read_irep_buf(mrb, bin, binsize);
+  if (irep == NULL) {
+    mrb_raisef(mrb, E_LOAD_ERROR, "load error - %S", name);
+  }
+  mrbx_mob_push(mrb, mob, irep, (mrbx_mob_free_f *)mrb_irep_decref);
+  struct RProc *proc = mrb_proc_new(mrb, irep);
+  mrbx_mob_pop(mrb, mob, irep);
+  mrbx_mob_cleanup(mrb, mob);
+
+  return proc;
+}
+
+static mrb_value
+compile_from_rb(MRB, VALUE self)
+{
+  mrb_value vfs, name;
+  const char *signature, *code;
+  mrb_int codesize, flags = 0;
+  mrb_get_args(mrb, "oSzs|i", &vfs, &name, &signature, &code, &codesize, &flags);
+
+  int ai = mrb_gc_arena_save(mrb);
+  struct RProc *proc = compile_rb_proc(mrb, signature, code, codesize, flags);
+  mrb_gc_arena_restore(mrb, ai);
+  mrb_gc_protect(mrb, VALUE(proc));
+  memory_report_irep(mrb, signature, proc);
+
+  exec_metered(mrb, signature, NULL, proc);
+  mrb_gc_arena_restore(mrb, ai);
+
+  return Qnil;
+}
+
+static mrb_value
+load_from_mrb(MRB, VALUE self)
+{
+  mrb_value vfs, name;
+  const char *signature;
+  const uint8_t *bin;
+  mrb_int binsize;
+  mrb_get_args(mrb, "oSzs", &vfs, &name, &signature, &bin, &binsize);
+
+  int ai = mrb_gc_arena_save(mrb);
+  struct RProc *proc = load_mrb_proc(mrb, name, bin, binsize);
+  mrb_gc_arena_restore(mrb, ai);
+  mrb_gc_protect(mrb, VALUE(proc));
+  memory_report_irep(mrb, signature, proc);
+
+  exec_metered(mrb, signature, NULL, proc);
+  mrb_gc_arena_restore(mrb, ai);
+
+  return Qnil;
+}
+
+/*
+ * `Kernel#load` のために、実行せずに Proc オブジェクトとして返す。
+ * 返された Proc は Central.exec_on_toplevel で繰り返し実行できる。
+ */
+static mrb_value
+compile_rb(MRB, VALUE self)
+{
+  mrb_value vfs, name;
+  const char *signature, *code;
+  mrb_int codesize, flags = 0;
+  mrb_get_args(mrb, "oSzs|i", &vfs, &name, &signature, &code, &codesize, &flags);
+
+  return VALUE(compile_rb_proc(mrb, signature, code, codesize, flags));
+}
+
+static mrb_value
+load_mrb(MRB, VALUE self)
+{
+  mrb_value vfs, name;
+  const char *signature;
+  const uint8_t *bin;
+  mrb_int binsize;
+  mrb_get_args(mrb, "oSzs", &vfs, &name, &signature, &bin, &binsize);
+
+  return VALUE(load_mrb_proc(mrb, name, bin, binsize));
+}
+
+static mrb_value
+exec_on_toplevel(MRB, VALUE self)
+{
+  mrb_value proc;
+  mrb_get_args(mrb, "o", &proc);
+  mrb_check_type(mrb, proc, MRB_TT_PROC);
+
+  aux_exec_proc_on_toplevel(mrb, mrb_proc_ptr(proc));
+
+  return Qnil;
+}
+
+static struct loadso_spec *
+prepare_linkage(MRB)
+{
+  mrb_value loadedso = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
+  mrb_data_check_type(mrb, loadedso, &loaded_shared_object_type);
+  struct loadso_spec *p = (struct loadso_spec *)DATA_PTR(loadedso);
+
+  /*
+   * 最初にロードする時か、以前ロードを試みて成功した時に新しい領域を確保する。
+   * 以前失敗した場合は NULL で埋めてあるだけなので、再利用する。
+   */
+  if (p == NULL || p->linkage != NULL) {
+    struct loadso_spec *o = (struct loadso_spec *)mrb_calloc(mrb, 1, sizeof(struct loadso_spec));
+    o->next = p;
+    DATA_PTR(loadedso) = p = o;
+  }
+
+  return p;
+}
+
+/*
+ * FNV-1a (64 bits)
+ */
+static uint64_t
+digest_binary(const void *bin, size_t binsize)
+{
+  const uint8_t *p = (const uint8_t *)bin;
+  const uint8_t *end = p + binsize;
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+  for (; p < end; p ++) {
+    h ^= *p;
+    h *= UINT64_C(0x100000001b3);
+  }
+
+  return h;
+}
+
+/*
+ * 既に読み込まれている、同じ内容の共有オブジェクトを探す。
+ */
+static struct loadso_spec *
+find_linkage(MRB, uint64_t digest, const void *bin, size_t binsize)
+{
+  mrb_value loadedso = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
+  mrb_data_check_type(mrb, loadedso, &loaded_shared_object_type);
+  struct loadso_spec *p = (struct loadso_spec *)DATA_PTR(loadedso);
+
+  for (; p; p = p->next) {
+    if (p->linkage && p->bin && p->digest == digest && p->binsize == binsize &&
+        memcmp(p->bin, bin, binsize) == 0) {
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
+static void so_rmdir_and_free_heap(MRB, void *ptr) { rmdir((const char *)ptr); mrb_free(mrb, ptr); }
+static void so_file_delete_and_free_heap(MRB, void *ptr) { unlink((const char *)ptr); mrb_free(mrb, ptr); }
+static void so_fd_close(MRB, void *ptr) { close((int)(uintptr_t)ptr); }
+static void so_dl_close(MRB, void *ptr) { dlclose(ptr); }
+
+static const char *
+tmpdir_root(void)
+{
+  const char *tmproot;
+
+  if ((tmproot = getenv("MRUBY_REQUIRE_PLUS_TMPDIR")) == NULL &&
+      (tmproot = getenv("TMPDIR")) == NULL &&
+      (tmproot = getenv("TEMP")) == NULL &&
+      (tmproot = getenv("TMP")) == NULL) {
+    tmproot = "/tmp";
+  }
+
+  return tmproot;
+}
+
+static const char *
+make_tmpdir(MRB, VALUE mob)
+{
+  /* template は C++ のキーワードなので…… */
+  static const char temprate[] = "mruby-require+XXXXXXXXXXXXXXXXXXXXXXXX";
+  const char *tmproot = tmpdir_root();
+
+  char *s = (char *)mrbx_mob_malloc(mrb, mob, strlen(tmproot) + strlen("/") + strlen(temprate) + 1);
+  s[0] = '\0';
+  strcat(s, tmproot);
+  aux_add_pathsep(s, strlen(s));
+  strcat(s, temprate);
+  mktemp(s);
+  if (mkdir(s, 0700) != 0) { return NULL; }
+  mrbx_mob_push(mrb, mob, s, so_rmdir_and_free_heap);
+
+  return s;
+}
+
+static const char *
+make_tmpname(MRB, VALUE mob, const char tmpdir[], const char name[])
+{
+  char *tmpname = (char *)mrbx_mob_malloc(mrb, mob, strlen(tmpdir) + strlen("/") + strlen(name) + 1);
+
+  tmpname[0] = '\0';
+  strcat(tmpname, tmpdir);
+  strcat(tmpname, "/");
+  strcat(tmpname, name);
+
+  return tmpname;
+}
+
+/*
+ * 未解決のシンボルを読み込みの時点で検出できるように、常に RTLD_NOW で開く。
+ * RTLD_LAZY で開いてから RTLD_NOW で開き直しても、既に読み込まれたものが返されるだけで再配置は行われない。
+ */
+static void *
+masquerade_dlopen(MRB, VALUE mob, const char name[], const void *bin, size_t binsize)
+{
+  const char *tmpdir = make_tmpdir(mrb, mob);
+  if (tmpdir == NULL) { return NULL; }
+
+  const char *tmpname = make_tmpname(mrb, mob, tmpdir, name);
+  if (tmpname == NULL) { return NULL; }
+
+  enum {
+#ifdef HAVE_FDLOPEN
+    open_mode = O_RDWR | O_CREAT | O_TRUNC | O_EXCL | O_EXLOCK | O_NOFOLLOW | O_DIRECT
+#else
+    open_mode = O_WRONLY | O_CREAT | O_TRUNC | O_EXCL | O_EXLOCK | O_NOFOLLOW | O_DIRECT
+#endif
+  };
+
+  int fd = open(tmpname, open_mode, 0700);
+  if (fd == -1) { return NULL; }
+  mrbx_mob_push(mrb, mob, (void *)tmpname, so_file_delete_and_free_heap);
+  mrbx_mob_push(mrb, mob, (void *)(uintptr_t)fd, so_fd_close);
+  errno = 0;
+
+#ifdef HAVE_FDLOPEN
+  mrbx_mob_free(mrb, mob, (void *)tmpname);
+  if (write(fd, bin, binsize) != binsize) { return NULL; }
+  //fcntl(fd, F_SETFL, O_RDONLY | O_EXLOCK | O_NOFOLLOW);
+  void *handle = fdlopen(fd, RTLD_NOW);
+  mrbx_mob_free(mrb, mob, (void *)(uintptr_t)fd);
+#else
+  if (write(fd, bin, binsize) != binsize) { return NULL; }
+  mrbx_mob_free(mrb, mob, (void *)(uintptr_t)fd);
+  void *handle = dlopen(tmpname, RTLD_NOW);
+  mrbx_mob_free(mrb, mob, (void *)tmpname);
+#endif
+
+  if (handle) {
+    mrbx_mob_push(mrb, mob, handle, so_dl_close);
+  }
+
+  return handle;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * 共有オブジェクトの先行読み込み (predlopen)。
+ *
+ * ファイルシステム上の共有オブジェクトを別スレッドで一時ファイルに書き出して dlopen() しておき、
+ * `load_shared_object()` では初期化関数と irep の実行だけを行えるようにする。
+ * 作業スレッドは mrb_state に一切触れないため、メモリ確保には malloc() を用いる。
+ *
+ * ファイルは、ロードパスのディレクトリのファイル記述子を複製したものからの相対パスで開く。
+ * 作業スレッドが動き出すまでに作業ディレクトリの移動やシンボリックリンクの付け替えがあっても、
+ * 探索した時と同じディレクトリから読み込まれる。
+ */
+struct predlopen_job
+{
+  struct predlopen_job *next;
+  pthread_t thread;
+  bool joined;
+  char *signature;
+  int dirfd;
+  char *path;     /* dirfd からの相対パス */
+  char *name;
+
+  /* 以下は作業スレッドが設定する */
+  void *handle;
+  uint64_t digest;
+  char *bin;
+  size_t binsize;
+};
+
+/*
+ * 作業スレッドからファイル全体を読み込む。戻り値は malloc() された領域。
+ */
+static char *
+slurp_file(int dirfd, const char path[], size_t *size)
+{
+  int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) { return NULL; }
+
+  struct stat st;
+  char *bin = NULL;
+  size_t off = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (bin = (char *)malloc(st.st_size + 1)) != NULL) {
+    while (off < (size_t)st.st_size) {
+      ssize_t n = read(fd, bin + off, st.st_size - off);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { break; }
+      off += n;
+    }
+  }
+  close(fd);
+
+  *size = off;
+  return bin;
+}
+
+static void *
+predlopen_worker(void *ptr)
+{
+  struct predlopen_job *job = (struct predlopen_job *)ptr;
+
+  size_t off;
+  char *bin = slurp_file(job->dirfd, job->path, &off);
+  if (bin == NULL) { return NULL; }
+
+  int fd;
+
+  char tmpname[PATH_MAX];
+  int len = snprintf(tmpname, sizeof(tmpname), "%s/mruby-require+XXXXXXXXXXXXXXXXXXXXXXXX", tmpdir_root());
+  if (len > 0 && (size_t)len < sizeof(tmpname) && mkdtemp(tmpname) != NULL) {
+    size_t dirlen = strlen(tmpname);
+    if (snprintf(tmpname + dirlen, sizeof(tmpname) - dirlen, "/%s", job->name) < (int)(sizeof(tmpname) - dirlen)) {
+      fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0700);
+      if (fd != -1) {
+        bool written = (write(fd, bin, off) == (ssize_t)off);
+        close(fd);
+        if (written) {
+          job->handle = dlopen(tmpname, RTLD_NOW);
+          job->digest = digest_binary(bin, off);
+          job->bin = bin;
+          job->binsize = off;
+          bin = NULL;
+        }
+        unlink(tmpname);
+      }
+    }
+    tmpname[dirlen] = '\0';
+    rmdir(tmpname);
+  }
+
+  free(bin);
+
+  return NULL;
+}
+
+static void
+predlopen_job_free(struct predlopen_job *job)
+{
+  if (!job->joined) { pthread_join(job->thread, NULL); }
+  if (job->dirfd >= 0) { close(job->dirfd); }
+  if (job->handle) { dlclose(job->handle); }
+  free(job->bin);
+  free(job->signature);
+  free(job->path);
+  free(job->name);
+  free(job);
+}
+
+static void
+predlopen_free(MRB, void *ptr)
+{
+  struct predlopen_job *job = (struct predlopen_job *)ptr;
+  while (job) {
+    struct predlopen_job *next = job->next;
+    predlopen_job_free(job);
+    job = next;
+  }
+}
+
+static const mrb_data_type predlopen_type = { "predlopen@require+", predlopen_free };
+
+#define id_predlopen SYMBOL("predlopen@require+")
+
+/*
+ * シグネチャに対する先行読み込みを取り出す。
+ * 作業スレッドが終わっていなければ待つ。読み込み後にファイルの内容が変わっていた場合は使わない。
+ */
+static void *
+predlopen_take(MRB, const char signature[], uint64_t digest, const void *bin, size_t binsize)
+{
+  VALUE jobs = mrb_gv_get(mrb, id_predlopen);
+  if (mrb_data_check_get_ptr(mrb, jobs, &predlopen_type) == NULL) { return NULL; }
+
+  struct predlopen_job **pp = (struct predlopen_job **)&DATA_PTR(jobs);
+  for (; *pp; pp = &(*pp)->next) {
+    struct predlopen_job *job = *pp;
+    if (strcmp(job->signature, signature) != 0) { continue; }
+
+    *pp = job->next;
+    pthread_join(job->thread, NULL);
+    job->joined = true;
+
+    void *handle = NULL;
+    if (job->bin && job->digest == digest && job->binsize == binsize &&
+        memcmp(job->bin, bin, binsize) == 0) {
+      handle = job->handle;
+      job->handle = NULL;
+    }
+    predlopen_job_free(job);
+
+    return handle;
+  }
+
+  return NULL;
+}
+
+static char *
+predlopen_strdup(const char *str, size_t len)
+{
+  char *s = (char *)malloc(len + 1);
+  if (s) {
+    memcpy(s, str, len);
+    s[len] = '\0';
+  }
+  return s;
+}
+
+/*
+ * call-seq:
+ *  predlopen_start(dir, path, signature) -> true or false
+ *
+ * `dir` を基点とする共有オブジェクト `path` の先行読み込みを開始する。
+ */
+static VALUE
+ext_predlopen_start(MRB, VALUE self)
+{
+  VALUE dir, path, signature;
+  mrb_get_args(mrb, "SSS", &dir, &path, &signature);
+
+  VALUE jobs = mrb_gv_get(mrb, id_predlopen);
+  mrb_data_check_type(mrb, jobs, &predlopen_type);
+
+  struct predlopen_job *job;
+  for (job = (struct predlopen_job *)DATA_PTR(jobs); job; job = job->next) {
+    if (strlen(job->signature) == (size_t)RSTRING_LEN(signature) &&
+        memcmp(job->signature, RSTRING_PTR(signature), RSTRING_LEN(signature)) == 0) {
+      return mrb_true_value();
+    }
+  }
+
+  char buf[PATH_MAX];
+  int dirfd = sysdir_dup(mrb, dir, path, buf, sizeof(buf));
+  if (dirfd == -1) { return mrb_false_value(); }
+
+  mrbx_component_name cn = mrbx_split_path(RSTRING_PTR(path), RSTRING_LEN(path));
+
+  job = (struct predlopen_job *)calloc(1, sizeof(struct predlopen_job));
+  if (job == NULL) {
+    if (dirfd >= 0) { close(dirfd); }
+    return mrb_false_value();
+  }
+  job->joined = true;
+  job->dirfd = dirfd;
+  job->signature = predlopen_strdup(RSTRING_PTR(signature), RSTRING_LEN(signature));
+  job->path = predlopen_strdup(buf, strlen(buf));
+  job->name = predlopen_strdup(cn.basename, cn.nameterm - cn.basename);
+  if (job->signature == NULL || job->path == NULL || job->name == NULL ||
+      pthread_create(&job->thread, NULL, predlopen_worker, job) != 0) {
+    predlopen_job_free(job);
+    return mrb_false_value();
+  }
+  job->joined = false;
+
+  job->next = (struct predlopen_job *)DATA_PTR(jobs);
+  DATA_PTR(jobs) = job;
+
+  return mrb_true_value();
+}
+
+/*
+ * ファイルの非同期読み込み (RequirePlus.require_async)。
+ *
+ * RequirePlus::Central::AsyncRead のインスタンスとして扱われ、作業スレッドが読み込みを終えたかどうかを
+ * `done?` で確認し、`take` で内容を受け取る (終わっていなければ待つ)。
+ */
+struct async_read
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  bool joined;
+  bool done;
+  int dirfd;
+  char *path;     /* dirfd からの相対パス */
+  char *data;
+  size_t size;
+};
+
+static void *
+async_read_worker(void *ptr)
+{
+  struct async_read *job = (struct async_read *)ptr;
+
+  size_t size = 0;
+  char *data = slurp_file(job->dirfd, job->path, &size);
+
+  pthread_mutex_lock(&job->lock);
+  job->data = data;
+  job->size = size;
+  job->done = true;
+  pthread_mutex_unlock(&job->lock);
+
+  return NULL;
+}
+
+static void
+async_read_join(struct async_read *job)
+{
+  if (job->joined) { return; }
+  pthread_join(job->thread, NULL);
+  job->joined = true;
+}
+
+static void
+async_read_free(MRB, void *ptr)
+{
+  struct async_read *job = (struct async_read *)ptr;
+  if (job == NULL) { return; }
+  async_read_join(job);
+  pthread_mutex_destroy(&job->lock);
+  if (job->dirfd >= 0) { close(job->dirfd); }
+  free(job->data);
+  free(job->path);
+  free(job);
+}
+
+static const mrb_data_type async_read_type = { "async read@require+", async_read_free };
+
+/*
+ * call-seq:
+ *  async_read_start(dir, path) -> AsyncRead instance or nil
+ */
+static VALUE
+ext_async_read_start(MRB, VALUE self)
+{
+  VALUE dir, path;
+  mrb_get_args(mrb, "SS", &dir, &path);
+
+  struct RClass *klass = mrb_class_get_under(mrb, mrb_module_get_under(mrb, mrb_module_get(mrb, "RequirePlus"), "Central"), "AsyncRead");
+  struct RData *d = mrb_data_object_alloc(mrb, klass, NULL, &async_read_type);
+
+  char buf[PATH_MAX];
+  int dirfd = sysdir_dup(mrb, dir, path, buf, sizeof(buf));
+  if (dirfd == -1) { return Qnil; }
+
+  struct async_read *job = (struct async_read *)calloc(1, sizeof(struct async_read));
+  if (job == NULL) {
+    if (dirfd >= 0) { close(dirfd); }
+    return Qnil;
+  }
+  job->joined = true;
+  job->dirfd = dirfd;
+  pthread_mutex_init(&job->lock, NULL);
+  if ((job->path = predlopen_strdup(buf, strlen(buf))) == NULL ||
+      pthread_create(&job->thread, NULL, async_read_worker, job) != 0) {
+    async_read_free(mrb, job);
+    return Qnil;
+  }
+  job->joined = false;
+  d->data = job;
+
+  return VALUE(d);
+}
+
+static VALUE
+async_read_done_p(MRB, VALUE self)
+{
+  struct async_read *job = (struct async_read *)mrb_data_get_ptr(mrb, self, &async_read_type);
+  if (job == NULL) { return mrb_true_value(); }
+
+  pthread_mutex_lock(&job->lock);
+  bool done = job->done;
+  pthread_mutex_unlock(&job->lock);
+
+  return mrb_bool_value(done);
+}
+
+/*
+ * 読み込んだ内容を文字列として返す。読み込めなかった場合は nil を返す。
+ * 一度しか受け取れない。
+ */
+static VALUE
+async_read_take(MRB, VALUE self)
+{
+  struct async_read *job = (struct async_read *)mrb_data_get_ptr(mrb, self, &async_read_type);
+  if (job == NULL) { return Qnil; }
+
+  async_read_join(job);
+  VALUE str = Qnil;
+  if (job->data && (uint64_t)job->size < mruby_require_plus_loadsize_max(mrb)) {
+    str = mrb_str_new(mrb, job->data, job->size);
+  }
+  free(job->data);
+  job->data = NULL;
+
+  return str;
+}
+
+#ifdef MRB_EACH_OBJ_OK
+static int
+#else
+static void
+#endif
+async_read_join_each(MRB, struct RBasic *obj, void *data)
+{
+  if (obj->tt == MRB_TT_DATA && ((struct RData *)obj)->type == &async_read_type && ((struct RData *)obj)->data) {
+    async_read_join((struct async_read *)((struct RData *)obj)->data);
+  }
+
+#ifdef MRB_EACH_OBJ_OK
+  return MRB_EACH_OBJ_OK;
+#endif
+}
+
+/*
+ * 全ての作業スレッド (先行読み込みと非同期読み込み) の終了を待つ。結果はそのまま保持される。
+ *
+ * fork() した子プロセスには呼び出したスレッドしか引き継がれないため、その前に呼ぶ。
+ * 書き込み途中の一時ファイルや、終わることのない読み込みが子プロセスに残らないようにする。
+ */
+static void
+workers_join(MRB)
+{
+  struct predlopen_job *job = (struct predlopen_job *)mrb_data_check_get_ptr(mrb, mrb_gv_get(mrb, id_predlopen), &predlopen_type);
+  for (; job; job = job->next) {
+    if (job->joined) { continue; }
+    pthread_join(job->thread, NULL);
+    job->joined = true;
+  }
+
+  mrb_objspace_each_objects(mrb, async_read_join_each, NULL);
+}
+
+static void
+init_async_read(MRB, struct RClass *central)
+{
+  struct RClass *klass = mrb_define_class_under(mrb, central, "AsyncRead", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, klass, "new");
+  mrb_define_method(mrb, klass, "done?", async_read_done_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, klass, "take", async_read_take, MRB_ARGS_NONE());
+}
+#else
+static void *
+predlopen_take(MRB, const char signature[], uint64_t digest, const void *bin, size_t binsize)
+{
+  return NULL;
+}
+
+static VALUE
+ext_predlopen_start(MRB, VALUE self)
+{
+  return mrb_false_value();
+}
+
+static VALUE
+ext_async_read_start(MRB, VALUE self)
+{
+  return Qnil;
+}
+
+static void
+workers_join(MRB)
+{
+}
+
+static void
+init_async_read(MRB, struct RClass *central)
+{
+}
+#endif
+
+static mrb_value
+load_shared_object(MRB, VALUE self)
+{
+  mrb_value vfs, name;
+  const char *signature, *bin;
+  mrb_int binsize;
+  mrb_get_args(mrb, "oSzs", &vfs, &name, &signature, &bin, &binsize);
+
+  int ai = mrb_gc_arena_save(mrb);
+  VALUE mob = mrbx_mob_create(mrb);
+
+  mrb_str_strlen(mrb, mrb_str_ptr(name)); /* 途中に NUL が含まれていないことが保証される */
+
+  mrbx_component_name cn = mrbx_split_path(RSTRING_PTR(name), RSTRING_LEN(name));
+  VALUE base;
+  if (cn.nameterm - cn.extname == 3 && memcmp(cn.extname, ".so", 3) == 0) {
+    base = mrb_str_new(mrb, cn.basename, cn.extname - cn.basename);
+  } else {
+    base = mrb_str_new(mrb, cn.basename, cn.nameterm - cn.basename);
+  }
+  VALUE descname = mrb_str_new(mrb, NULL, 0);
+  make_descname(mrb, descname, RSTRING_PTR(base));
+
+  /*
+   * 同じ内容のバイナリが読み込み済みであれば、一時ファイルへの書き出しと dlopen() を省いてそのハンドルを使う。
+   */
+  uint64_t digest = digest_binary(bin, binsize);
+  struct loadso_spec *origin = find_linkage(mrb, digest, bin, binsize);
+  void *handle;
+  if (origin) {
+    handle = origin->linkage;
+  } else if ((handle = predlopen_take(mrb, signature, digest, bin, binsize)) != NULL) {
+    mrbx_mob_push(mrb, mob, handle, so_dl_close);
+  } else {
+    handle = masquerade_dlopen(mrb, mob, RSTRING_PTR(name), bin, binsize);
+    if (handle == NULL) { goto raise_exc; }
+  }
+
+  {
+    mruby_require_plus_init_f *init;
+    mruby_require_plus_final_f *final;
+    const void *irepbin;
+    bool unloadable = false;
+
+    /*
+     * 記述子があれば、一度の dlsym() で済ませ、ABI の指紋を確かめてから使う。
+     * 確かめられるのは dlopen() の後なので、防げるのは初期化関数と irep の実行だけである。
+     */
+    const struct mruby_require_plus_descriptor *desc = (const struct mruby_require_plus_descriptor *)dlsym(handle, RSTRING_PTR(descname));
+    if (desc) {
+      if (desc->magic != MRUBY_REQUIRE_PLUS_DESCRIPTOR_MAGIC ||
+          desc->release != MRUBY_RELEASE_NO ||
+          desc->config != MRUBY_REQUIRE_PLUS_ABI_CONFIG) {
+        /* 設定はビットの組み合わせなので、比べやすいように 16 進数で示す */
+        char built[16], running[16];
+        snprintf(built, sizeof(built), "0x%08x", (unsigned int)desc->config);
+        snprintf(running, sizeof(running), "0x%08x", (unsigned int)MRUBY_REQUIRE_PLUS_ABI_CONFIG);
+        mrbx_mob_cleanup(mrb, mob);
+        mrb_gc_arena_restore(mrb, ai);
+        mrb_raisef(mrb, E_LOAD_ERROR,
+                   "incompatible ABI - %S (built for mruby %S with config %S, but running mruby %S with config %S)",
+                   name,
+                   mrb_fixnum_value((mrb_int)desc->release), mrb_str_new_cstr(mrb, built),
+                   mrb_fixnum_value(MRUBY_RELEASE_NO), mrb_str_new_cstr(mrb, running));
+      }
+
+      init = desc->init;
+      final = desc->final;
+      irepbin = desc->irep;
+      unloadable = (desc->flags & MRUBY_REQUIRE_PLUS_UNLOADABLE) != 0;
+    } else {
+      VALUE funcname = mrb_str_new(mrb, NULL, 0);
+      init = (mruby_require_plus_init_f *)dlfunc(handle, make_initname(mrb, funcname, RSTRING_PTR(base)));
+      final = (mruby_require_plus_final_f *)dlfunc(handle, make_finalname(mrb, funcname, RSTRING_PTR(base)));
+      irepbin = dlsym(handle, make_irepname(mrb, funcname, RSTRING_PTR(base)));
+    }
+
+    if (init == NULL && irepbin == NULL) { goto raise_exc; }
+
+    if (origin && origin->init == init && origin->irep == irepbin) {
+      /*
+       * 同じ初期化関数と irep が既に実行されているため、別のシグネチャであっても改めて初期化しない。
+       * RequirePlus.unload のために、後処理関数を持たない要素として記録だけしておく。
+       */
+      mrbx_mob_cleanup(mrb, mob);
+      mrb_gc_arena_restore(mrb, ai);
+
+      struct loadso_spec *p = prepare_linkage(mrb);
+      p->linkage = handle;
+      p->init = init;
+      p->irep = irepbin;
+      p->digest = digest;
+      p->binsize = binsize;
+      p->borrowed = true;
+      p->unloadable = unloadable;
+      loadso_set_signature(mrb, p, signature);
+
+      return Qnil;
+    }
+
+    void *bincopy = NULL;
+    if (!origin) {
+      bincopy = mrbx_mob_malloc(mrb, mob, binsize);
+      memcpy(bincopy, bin, binsize);
+      mrbx_mob_pop(mrb, mob, bincopy);
+      mrbx_mob_pop(mrb, mob, handle);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+    mrb_gc_protect(mrb, mob);
 
     struct loadso_spec *p = prepare_linkage(mrb);
     p->linkage = handle;
+    p->init = init;
     p->final = final;
+    p->irep = irepbin;
+    p->digest = digest;
+    p->bin = bincopy;
+    p->binsize = binsize;
+    p->borrowed = (origin != NULL);
+    p->unloadable = unloadable;
+    loadso_set_signature(mrb, p, signature);
+
+    if (!origin) {
+      memory_report_add(mrb, signature, SYMBOL("so"), binsize);
+    }
+
+    if (init) {
+      exec_metered(mrb, signature, init, NULL);
+      mrb_gc_arena_restore(mrb, ai);
+      mrb_gc_protect(mrb, mob);
+    }
+
+    if (irepbin) {
+      mrb_irep *irep = mrb_read_irep(mrb, (const uint8_t *)irepbin);
+      mrbx_mob_push(mrb, mob, irep, (mrbx_mob_free_f *)mrb_irep_decref);
+      struct RProc *proc = mrb_proc_new(mrb, irep);
+      mrbx_mob_pop(mrb, mob, irep);
+      mrbx_mob_cleanup(mrb, mob);
+
+      mrb_gc_arena_restore(mrb, ai);
+      mrb_gc_protect(mrb, VALUE(proc));
+      memory_report_irep(mrb, signature, proc);
+      exec_metered(mrb, signature, NULL, proc);
+    } else {
+      mrbx_mob_cleanup(mrb, mob);
+    }
+
+    mrb_gc_arena_restore(mrb, ai);
+
+    return Qnil;
+  }
+
+raise_exc:
+  mrbx_mob_cleanup(mrb, mob);
+  mrb_gc_arena_restore(mrb, ai);
+  mrb_raisef(mrb, E_LOAD_ERROR, "failed load %S (in %S)", name, vfs);
+  return Qnil; /* not reached */
+}
+
+/*
+ * 一覧から取り除かれた要素 `p` の後処理を行う。
+ *
+ * 同じハンドルを共有する要素が残っていれば、最も古いものにハンドルの所有権を移して dlclose() しない。
+ * 同じ初期化関数と irep を持つ要素が残っていれば、後処理関数もそちらに移して呼ばない。
+ *
+ * 後処理関数を呼んだ後に GC を行ってから dlclose() するため、後処理関数の中で解放できる
+ * MRB_TT_DATA オブジェクトの独自開放関数は、ライブラリが閉じられる前に呼ばれる。
+ *
+ * 記述子で MRUBY_REQUIRE_PLUS_UNLOADABLE が指定されていなければ dlclose() せず、
+ * ハンドルとバイナリの複製だけを持つ要素として一覧に戻す。
+ * 関数ポインタや文字列リテラルがどこかに残っていても SIGSEGV とはならず、
+ * 同じバイナリを再び読み込む時は dlopen() を省いて初期化関数から実行し直す。
+ */
+static void
+unload_shared_object(MRB, struct loadso_spec *p)
+{
+  mrb_value loadedso = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
+  struct loadso_spec *q = (struct loadso_spec *)mrb_data_check_get_ptr(mrb, loadedso, &loaded_shared_object_type);
+  struct loadso_spec *heir = NULL, *twin = NULL;
+
+  for (; q; q = q->next) {
+    if (p->linkage == NULL || q->linkage != p->linkage) { continue; }
+    heir = q; /* 一覧は新しい順なので、最後に見つかったものが最も古い */
+    if (q->init == p->init && q->irep == p->irep) { twin = q; }
+  }
+
+  mrb_bool failed = FALSE;
+  VALUE exc = Qnil;
+  if (twin) {
+    if (twin->final == NULL) { twin->final = p->final; }
+  } else if (p->final) {
+    exc = mrb_protect(mrb, loadso_free_trial, mrb_cptr_value(mrb, p), &failed);
+  }
+
+  mrb_full_gc(mrb);
+
+  if (heir) {
+    if (!p->borrowed) {
+      heir->borrowed = false;
+      heir->bin = p->bin;
+      p->bin = NULL;
+    }
+  } else if (p->linkage && !p->borrowed) {
+    if (!p->unloadable) {
+      p->init = NULL;
+      p->final = NULL;
+      p->irep = NULL;
+      mrb_free(mrb, p->signature);
+      p->signature = NULL;
+
+      mrb_value loadedso = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
+      p->next = (struct loadso_spec *)DATA_PTR(loadedso);
+      DATA_PTR(loadedso) = p;
+
+      if (failed) { mrb_exc_raise(mrb, exc); }
+      return;
+    }
+
+    dlclose(p->linkage);
+  }
+
+  mrb_free(mrb, p->bin);
+  mrb_free(mrb, p->signature);
+  mrb_free(mrb, p);
+
+  if (failed) { mrb_exc_raise(mrb, exc); }
+}
+
+/*
+ * call-seq:
+ *  unload_shared_object(signature) -> true or false
+ */
+static VALUE
+ext_unload_shared_object(MRB, VALUE self)
+{
+  const char *signature;
+  mrb_get_args(mrb, "z", &signature);
+
+  mrb_value loadedso = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
+  mrb_data_check_type(mrb, loadedso, &loaded_shared_object_type);
+
+  struct loadso_spec **pp = (struct loadso_spec **)&DATA_PTR(loadedso);
+  for (; *pp; pp = &(*pp)->next) {
+    struct loadso_spec *p = *pp;
+    if (p->signature == NULL || strcmp(p->signature, signature) != 0) { continue; }
+
+    *pp = p->next;
+    p->next = NULL;
+    unload_shared_object(mrb, p);
+
+    return mrb_true_value();
+  }
+
+  return mrb_false_value();
+}
+
+static VALUE
+joinpath(MRB, VALUE str, mrb_int argc, const VALUE argv[], bool *istermsep)
+{
+  /* FIXME: Windows だと ["C:", "/file"] の場合に "C:file" となってしまう */
+
+  for (; argc > 0; argc --, argv ++) {
+    VALUE tmp = *argv;
+
+    switch (mrb_type(tmp)) {
+    default:
+      tmp = mrb_funcall_argv(mrb, tmp, SYMBOL("to_path"), 0, NULL);
+      mrb_check_type(mrb, tmp, MRB_TT_STRING);
+      /* fall through */
+    case MRB_TT_STRING:
+      {
+        const char *s = RSTRING_PTR(tmp);
+        mrb_int slen = RSTRING_LEN(tmp);
+
+        if (mrb_nil_p(str)) {
+          str = mrb_str_new(mrb, s, slen);
+          *istermsep = !mrbx_need_pathsep_p(s, slen);
+        } else if (slen > 0) {
+          if (!(!!*istermsep ^ !!mrbx_pathsep_p(s[0]))) {
+            /* 末尾が "/" で終わっておりかつ追加しようとしている文字列が "/" で始まる場合、
+             * あるいは連結する時に "/" を必要とする場合は処理する */
+            if (*istermsep) {
+              s ++;
+              slen --;
+            } else {
+              mrb_str_cat_cstr(mrb, str, "/");
+            }
+          }
+
+          if (slen > 0) {
+            *istermsep = mrbx_pathsep_p(s[slen - 1]);
+            mrb_str_cat(mrb, str, s, slen);
+          }
+        }
+      }
+
+      break;
+    case MRB_TT_ARRAY:
+      str = joinpath(mrb, str, ARY_LEN(mrb_ary_ptr(tmp)), ARY_PTR(mrb_ary_ptr(tmp)), istermsep);
+      break;
+    }
+  }
+
+  return str;
+}
+
+static bool
+split_frame_info(const char *info, const size_t len, const char **pathterm, int *line)
+{
+  const char *beg = info;
+  const uintptr_t end = (uintptr_t)info + len;
+  const char *path;
+  int linenum;
+  *pathterm = NULL;
+
+retry:
+  for (;; info ++) {
+    if (end - (uintptr_t)info <= 0 || *info == '\0') {
+      return *pathterm != NULL && *pathterm - beg > 0;
+    } else if (*info == ':') {
+      path = info ++;
+      break;
+    }
+  }
+
+retry_line:
+  if (end - (uintptr_t)info <= 0 || !isdigit((uint8_t)*info)) {
+    goto retry;
+  }
+
+  linenum = 0;
+  for (;; info ++) {
+    if (end - (uintptr_t)info <= 0 || *info == '\0') {
+      if (linenum > 0) {
+        *pathterm = path;
+        *line = linenum;
+        return *pathterm - beg > 0;
+      } else {
+        return false;
+      }
+    } else if (*info == ':') {
+      info ++;
+      break;
+    } else if (!isdigit((uint8_t)*info)) {
+      goto retry;
+    } else {
+      linenum = linenum * 10 + digittoint((uint8_t)*info);
+    }
+  }
+
+  if (end - (uintptr_t)info < 3 ||
+      info[0] != 'i' || info[1] != 'n' || info[2] != ' ') {
+    path = info - 1;
+    goto retry_line;
+  }
+  info += 3;
+
+  for (;; info ++) {
+    if (end - (uintptr_t)info <= 0 || *info == '\0') {
+      *pathterm = path;
+      *line = linenum;
+      return *pathterm - beg > 0;
+    } else if (*info == ':') {
+      *pathterm = path;
+      *line = linenum;
+      path = info ++;
+      goto retry_line;
+    }
+  }
+}
+
+static VALUE
+split_frame_info_value(MRB, VALUE frame)
+{
+  mrb_check_type(mrb, frame, MRB_TT_STRING);
+  const char *info = RSTRING_PTR(frame);
+  size_t len = RSTRING_LEN(frame);
+  const char *pathterm;
+  int line;
+
+  if (!split_frame_info(info, len, &pathterm, &line)) {
+    return Qnil;
+  }
+
+  return MRBX_TUPLE(mrb_str_new(mrb, info, pathterm - info), mrb_fixnum_value(line));
+}
+
+static VALUE
+ext_split_frame_info(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  return split_frame_info_value(mrb, self);
+}
+
+static VALUE
+ext_get_upper_frame(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  VALUE bt = mrb_get_backtrace(mrb);
+  VALUE uf = mrb_ary_ref(mrb, bt, 1);
+  if (!mrb_string_p(uf)) { return Qnil; }
+  return split_frame_info_value(mrb, uf);
+}
+
+static VALUE
+ext_makepath(MRB, VALUE self)
+{
+  mrb_int argc;
+  VALUE *argv;
+
+  switch (mrb_get_args(mrb, "*", &argv, &argc)) {
+  case 0:
+    return mrb_str_new(mrb, NULL, 0);
+  case 1:
+    return mrb_to_str(mrb, argv[0]);
+  }
+
+  bool istermsep = false;
+
+  return joinpath(mrb, Qnil, argc, argv, &istermsep);
+}
+
+static VALUE
+ext_dirname(MRB, VALUE self)
+{
+  VALUE arg0;
+  mrb_get_args(mrb, "S", &arg0);
+  const char *path = RSTRING_PTR(arg0);
+  size_t len = RSTRING_LEN(arg0);
+  mrbx_component_name cn = mrbx_split_path(path, len);
+
+  if (cn.dirterm == path) {
+    return mrb_str_new_lit(mrb, ".");
+  } else {
+    return mrb_str_new(mrb, path, cn.dirterm - path);
+  }
+}
+
+static VALUE
+ext_basename(MRB, VALUE self)
+{
+  VALUE arg0, arg1 = Qnil;
+  mrb_get_args(mrb, "S|S", &arg0, &arg1);
+  const char *path = RSTRING_PTR(arg0);
+  size_t len = RSTRING_LEN(arg0);
+  mrbx_component_name cn = mrbx_split_path(path, len);
+
+  if (cn.nameterm == path) {
+    return mrb_str_new_lit(mrb, ".");
+  } else if (!mrb_nil_p(arg1)) {
+    if (strcmp(".*", RSTRING_PTR(arg1)) == 0 ||
+        strncmp(cn.extname, RSTRING_PTR(arg1), cn.nameterm - cn.extname) == 0) {
+      return mrb_str_new(mrb, cn.basename, cn.extname - cn.basename);
+    }
+  }
+
+  return mrb_str_new(mrb, cn.basename, cn.nameterm - cn.basename);
+}
+
+static VALUE
+ext_extname(MRB, VALUE self)
+{
+  VALUE arg0;
+  mrb_get_args(mrb, "S", &arg0);
+  const char *path = RSTRING_PTR(arg0);
+  size_t len = RSTRING_LEN(arg0);
+  mrbx_component_name cn = mrbx_split_path(path, len);
+
+  if (cn.extname == cn.nameterm) {
+    return Qnil;
+  } else {
+    return mrb_str_new(mrb, cn.extname, cn.nameterm - cn.extname);
+  }
+}
+
+static VALUE
+ext_split_path(MRB, VALUE self)
+{
+  mrb_check_type(mrb, self, MRB_TT_STRING);
+  size_t pathlen = mrb_str_strlen(mrb, RSTRING(self));
+  const char *path = RSTRING_PTR(self);
+  mrbx_component_name cn = mrbx_split_path(path, pathlen);
+
+  return MRBX_TUPLE(mrb_str_new(mrb, path, cn.rootterm - path),
+                    mrb_str_new(mrb, path, cn.dirterm - path),
+                    mrb_str_new(mrb, cn.basename, cn.nameterm - cn.basename),
+                    mrb_str_new(mrb, cn.extname, cn.nameterm - cn.extname));
+}
+
+static VALUE
+ext_add_pathsep(MRB, VALUE self)
+{
+  mrb_check_type(mrb, self, MRB_TT_STRING);
+  mrb_str_modify(mrb, RSTRING(self));
+  aux_str_add_pathsep(mrb, self);
+  return self;
+}
+
+static VALUE
+ext_whatmyname(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+
+  char path[PATH_MAX + 1];
+  int size = whatmyname(path, sizeof(path));
+  if (size > 0) {
+    return mrb_str_new(mrb, path, size);
+  } else {
+    return Qnil;
+  }
+}
+
+/*
+ * `dir` と `path`、`ext` を連結したパスを `buf` に格納する。
+ * 連結の規則は joinpath() と同じ。
+ *
+ * `buf` に収まらない場合や、途中に NUL が含まれる場合は NULL を返す。
+ */
+static const char *
+make_syspath(char *buf, size_t bufsize, const char *dir, size_t dirlen, const char *path, size_t pathlen, const char *ext, size_t extlen)
+{
+  if (memchr(dir, '\0', dirlen) || memchr(path, '\0', pathlen) || memchr(ext, '\0', extlen)) {
+    return NULL;
+  }
+
+  if (dirlen > 0 && pathlen > 0) {
+    bool termsep = !mrbx_need_pathsep_p(dir, dirlen);
+    if (termsep && mrbx_pathsep_p(path[0])) {
+      path ++;
+      pathlen --;
+    }
+    if (dirlen + 1 + pathlen + extlen + 1 > bufsize) { return NULL; }
+    memcpy(buf, dir, dirlen);
+    if (!termsep && !mrbx_pathsep_p(path[0])) {
+      buf[dirlen ++] = '/';
+    }
+  } else {
+    if (dirlen + pathlen + extlen + 1 > bufsize) { return NULL; }
+    memcpy(buf, dir, dirlen);
+  }
+
+  memcpy(buf + dirlen, path, pathlen);
+  memcpy(buf + dirlen + pathlen, ext, extlen);
+  buf[dirlen + pathlen + extlen] = '\0';
+
+  return buf;
+}
+
+#ifndef O_PATH
+# define O_PATH O_RDONLY
+#endif
+
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+# define SYSDIR_WITHOUT_FD 1
+# ifndef AT_FDCWD
+#  define AT_FDCWD (-100)
+# endif
+#else
+# include <dirent.h>
+# ifdef __APPLE__
+#  include <strings.h> /* for strncasecmp() */
+# endif
+#endif
+
+/*
+ * ディレクトリのファイル記述子を基点とするファイル操作。
+ * openat() などを持たない環境では `dirfd` を無視し、`path` は常に連結済みのパスとなる。
+ */
+#ifdef SYSDIR_WITHOUT_FD
+static int sys_stat(int dirfd, const char *path, struct stat *st) { return stat(path, st); }
+static int sys_open(int dirfd, const char *path, int flags, int mode) { return open(path, flags | O_BINARY, mode); }
+static int sys_unlink(int dirfd, const char *path) { return unlink(path); }
+static int sys_rename(int dirfd, const char *from, const char *to) { return (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1); }
+#else
+static int sys_stat(int dirfd, const char *path, struct stat *st) { return fstatat(dirfd, path, st, 0); }
+static int sys_open(int dirfd, const char *path, int flags, int mode) { return openat(dirfd, path, flags, mode); }
+static int sys_unlink(int dirfd, const char *path) { return unlinkat(dirfd, path, 0); }
+static int sys_rename(int dirfd, const char *from, const char *to) { return renameat(dirfd, from, dirfd, to); }
+#endif
+
+/*
+ * ロードパスのディレクトリ (sysdir)。
+ *
+ * 絶対パスのディレクトリは一度開いて保持し、以降の探索は openat() や fstatat() によってディレクトリからの相対パスだけで行う。
+ * 相対パスのディレクトリは作業ディレクトリの移動に追従させるため保持せず、毎回パスを連結する ("." も同じ扱い)。
+ *
+ * 保持したファイル記述子は `$:` の世代が変わると全て閉じる。
+ * また require のたびに (Central.sysdir_refresh)、最初の参照でディレクトリのパスを stat() し直し、
+ * シンボリックリンクの付け替えなどによって別のディレクトリを指すようになっていれば開き直す。
+ */
+struct sysdir_entry
+{
+  char *path;
+  size_t pathlen;
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  uint32_t epoch; /* 最後に確かめた時の sysdir_table::epoch */
+};
+
+struct sysdir_table
+{
+  struct sysdir_entry *entries;
+  size_t num, capa;
+  mrb_int generation;
+  uint32_t epoch;
+};
+
+/*
+ * 探索の基点。`fd` が AT_FDCWD であれば `prefix` を連結したパスを用いる。
+ */
+struct sysdir
+{
+  int fd;
+  const char *prefix;
+  size_t prefixlen;
+};
+
+static void
+sysdir_table_clear(MRB, struct sysdir_table *t)
+{
+  size_t i;
+  for (i = 0; i < t->num; i ++) {
+    close(t->entries[i].fd);
+    mrb_free(mrb, t->entries[i].path);
+  }
+  t->num = 0;
+}
+
+static void
+sysdir_table_free(MRB, void *ptr)
+{
+  struct sysdir_table *t = (struct sysdir_table *)ptr;
+  if (t == NULL) { return; }
+  sysdir_table_clear(mrb, t);
+  mrb_free(mrb, t->entries);
+  mrb_free(mrb, t);
+}
+
+static const mrb_data_type sysdir_table_type = { "sysdir table@require+", sysdir_table_free };
+
+#define id_sysdir_table SYMBOL("sysdir table@require+")
+
+static struct sysdir_table *
+get_sysdir_table(MRB)
+{
+  struct sysdir_table *t = (struct sysdir_table *)mrb_data_get_ptr(mrb, mrb_gv_get(mrb, id_sysdir_table), &sysdir_table_type);
+  if (t == NULL) { return NULL; }
+
+  mrb_int gen = mruby_require_plus_loadpath_generation(mrb);
+  if (t->generation != gen) {
+    sysdir_table_clear(mrb, t);
+    t->generation = gen;
+  }
+
+  return t;
+}
+
+#ifndef SYSDIR_WITHOUT_FD
+static void
+sysdir_entry_remove(MRB, struct sysdir_table *t, struct sysdir_entry *e)
+{
+  close(e->fd);
+  mrb_free(mrb, e->path);
+  *e = t->entries[-- t->num];
+}
+
+/*
+ * 絶対パスのディレクトリ `path` を開いたファイル記述子を返す。開けなかった場合は -1 を返す。
+ */
+static int
+sysdir_pin(MRB, const char *path, size_t pathlen)
+{
+  struct sysdir_table *t = get_sysdir_table(mrb);
+  if (t == NULL) { return -1; }
+
+  char buf[PATH_MAX];
+  struct stat st;
+  size_t i;
+  for (i = 0; i < t->num; i ++) {
+    struct sysdir_entry *e = &t->entries[i];
+    if (e->pathlen != pathlen || memcmp(e->path, path, pathlen) != 0) { continue; }
+    if (e->epoch == t->epoch) { return e->fd; }
+
+    if (make_syspath(buf, sizeof(buf), path, pathlen, "", 0, "", 0) != NULL &&
+        stat(buf, &st) == 0 && st.st_dev == e->dev && st.st_ino == e->ino) {
+      e->epoch = t->epoch;
+      return e->fd;
+    }
+
+    sysdir_entry_remove(mrb, t, e); /* 別のディレクトリに変わったか、取り除かれた */
+    break;
+  }
+
+  if (make_syspath(buf, sizeof(buf), path, pathlen, "", 0, "", 0) == NULL) { return -1; }
+
+  if (t->num >= t->capa) {
+    size_t capa = (t->capa < 8 ? 8 : t->capa * 2);
+    t->entries = (struct sysdir_entry *)mrb_realloc(mrb, t->entries, capa * sizeof(struct sysdir_entry));
+    t->capa = capa;
+  }
+  char *copy = (char *)mrb_malloc(mrb, pathlen + 1);
+  memcpy(copy, path, pathlen);
+  copy[pathlen] = '\0';
+
+  int fd = open(buf, O_DIRECTORY | O_PATH | O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    /* 後から作成されるかもしれないので、記録しない */
+    if (fd != -1) { close(fd); }
+    mrb_free(mrb, copy);
+    return -1;
+  }
+
+  struct sysdir_entry *e = &t->entries[t->num ++];
+  e->path = copy;
+  e->pathlen = pathlen;
+  e->fd = fd;
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->epoch = t->epoch;
+
+  return fd;
+}
+#endif
+
+/*
+ * ロードパスのディレクトリ `dir` を探索の基点として `sd` に設定する。
+ * `dir` が不正であれば偽を返す。
+ */
+static bool
+sysdir_get(MRB, VALUE dir, struct sysdir *sd)
+{
+  const char *p = RSTRING_PTR(dir);
+  size_t len = RSTRING_LEN(dir);
+  if (len < 1 || memchr(p, '\0', len) != NULL) { return false; }
+
+  sd->fd = AT_FDCWD;
+  sd->prefix = p;
+  sd->prefixlen = len;
+
+#ifndef SYSDIR_WITHOUT_FD
+  if (mrbx_pathsep_p(p[0])) {
+    int fd = sysdir_pin(mrb, p, len);
+    if (fd != -1) {
+      sd->fd = fd;
+      sd->prefix = "";
+      sd->prefixlen = 0;
+    }
+  }
+#endif
+
+  return true;
+}
+
+static void
+sysdir_close_all(MRB)
+{
+  struct sysdir_table *t = (struct sysdir_table *)mrb_data_check_get_ptr(mrb, mrb_gv_get(mrb, id_sysdir_table), &sysdir_table_type);
+  if (t) { sysdir_table_clear(mrb, t); }
+}
+
+/*
+ * call-seq:
+ *  sysdir_refresh -> nil
+ *
+ * 保持しているディレクトリを、次に参照した時に確かめ直すようにする。require のたびに呼ばれる。
+ */
+static VALUE
+ext_sysdir_refresh(MRB, VALUE self)
+{
+  struct sysdir_table *t = (struct sysdir_table *)mrb_data_check_get_ptr(mrb, mrb_gv_get(mrb, id_sysdir_table), &sysdir_table_type);
+  if (t) { t->epoch ++; }
+  return Qnil;
+}
+
+/*
+ * `sd` を基点とした `path + ext` を `buf` に格納する。
+ * ファイル記述子が基点であれば、パスの先頭の "/" は取り除かれ、常にディレクトリからの相対パスとなる。
+ */
+static const char *
+sysdir_path(char *buf, size_t bufsize, const struct sysdir *sd, const char *path, size_t pathlen, const char *ext, size_t extlen)
+{
+  if (sd->fd == AT_FDCWD) {
+    return make_syspath(buf, bufsize, sd->prefix, sd->prefixlen, path, pathlen, ext, extlen);
+  }
+
+  while (pathlen > 0 && mrbx_pathsep_p(path[0])) {
+    path ++;
+    pathlen --;
+  }
+
+  if (pathlen < 1) { return NULL; }
+
+  return make_syspath(buf, bufsize, "", 0, path, pathlen, ext, extlen);
+}
+
+/*
+ * 作業スレッドのために、ロードパスのディレクトリ `dir` のファイル記述子を複製して返す。
+ * `buf` には、それを基点とした `path` を格納する。
+ *
+ * 保持していない相対パスのディレクトリであれば、現在の作業ディレクトリを開いて返す。
+ * openat() を持たない環境では AT_FDCWD を返し、`buf` には連結したパスを格納する。
+ * 失敗した場合は -1 を返す。
+ */
+static int
+sysdir_dup(MRB, VALUE dir, VALUE path, char *buf, size_t bufsize)
+{
+  struct sysdir sd;
+  if (!sysdir_get(mrb, dir, &sd) ||
+      sysdir_path(buf, bufsize, &sd, RSTRING_PTR(path), RSTRING_LEN(path), "", 0) == NULL) {
+    return -1;
+  }
+
+#ifdef SYSDIR_WITHOUT_FD
+  return AT_FDCWD;
+#else
+  if (sd.fd == AT_FDCWD) {
+    return open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+# ifdef F_DUPFD_CLOEXEC
+  return fcntl(sd.fd, F_DUPFD_CLOEXEC, 0);
+# else
+  return dup(sd.fd);
+# endif
+#endif
+}
+
+/*
+ * 通常ファイルであればそのバイト数を、そうでなければ -1 を返す。
+ *
+ * `compressed` が真であれば圧縮ファイルのヘッダを読み、展開後のバイト数を返す。
+ */
+static mrb_int
+sysfile_size(const struct sysdir *sd, const char *path, size_t pathlen, const char *ext, size_t extlen, bool compressed)
+{
+  char buf[PATH_MAX];
+  struct stat st;
+
+  if (sysdir_path(buf, sizeof(buf), sd, path, pathlen, ext, extlen) == NULL ||
+      sys_stat(sd->fd, buf, &st) != 0 ||
+      !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+
+  if (compressed) {
+    uint8_t head[MRUBY_REQUIRE_PLUS_ZHEADER_SIZE];
+    int fd = sys_open(sd->fd, buf, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) { return -1; }
+    ssize_t n = read(fd, head, sizeof(head));
+    close(fd);
+    if (n != sizeof(head)) { return -1; }
+    int64_t size = mruby_require_plus_zheader_size(head, sizeof(head));
+    return (size < 0 ? -1 : (mrb_int)clamp(size, 0, MRB_INT_MAX));
+  }
+
+  return (mrb_int)clamp(st.st_size, 0, MRB_INT_MAX);
+}
+
+static bool
+extname_p(const char *path, size_t pathlen, const char *ext, size_t extlen)
+{
+  mrbx_component_name cn = mrbx_split_path(path, pathlen);
+  return (size_t)(cn.nameterm - cn.extname) == extlen && memcmp(cn.extname, ext, extlen) == 0;
+}
+
+/*
+ * `file + ext` と、`zext` が与えられていれば `file + ext + zext` を調べる。
+ */
+static VALUE
+find_sysfile_candidate(MRB, VALUE dir, VALUE file, const char *ext, size_t extlen, VALUE zext, bool withext)
+{
+  struct sysdir sd;
+  const char *filep = RSTRING_PTR(file);
+  size_t filelen = RSTRING_LEN(file);
+  size_t max = mruby_require_plus_loadsize_max(mrb);
+  mrb_int size;
+
+  if (!sysdir_get(mrb, dir, &sd)) { return Qnil; }
+
+  size = sysfile_size(&sd, filep, filelen, ext, extlen, false);
+  if (size >= 0 && (size_t)size < max) {
+    if (withext) { return file; }
+    VALUE path = mrb_str_new(mrb, NULL, filelen + extlen);
+    memcpy(RSTRING_PTR(path), filep, filelen);
+    memcpy(RSTRING_PTR(path) + filelen, ext, extlen);
+    return path;
+  }
+
+  if (mrb_string_p(zext)) {
+    char extz[64];
+    size_t zextlen = RSTRING_LEN(zext);
+    if (extlen + zextlen >= sizeof(extz)) { return Qnil; }
+    memcpy(extz, ext, extlen);
+    memcpy(extz + extlen, RSTRING_PTR(zext), zextlen);
+
+    size = sysfile_size(&sd, filep, filelen, extz, extlen + zextlen, true);
+    if (size >= 0 && (size_t)size < max) {
+      VALUE path = mrb_str_new(mrb, NULL, filelen + extlen + zextlen);
+      memcpy(RSTRING_PTR(path), filep, filelen);
+      memcpy(RSTRING_PTR(path) + filelen, extz, extlen + zextlen);
+      return path;
+    }
+  }
+
+  return Qnil;
+}
+
+/*
+ * Central.find_file の、ファイルシステム向けの実装。
+ *
+ * 文字列オブジェクトを確保するのは見つかった場合だけで、探索中はスタック上のバッファしか使わない。
+ * `withext` が真であれば `file` をそのまま、偽であれば `file + ext` を調べる。
+ */
+static VALUE
+find_sysfile_trial(MRB, VALUE dir, VALUE file, VALUE exts, VALUE zext, bool withext)
+{
+  if (mrb_array_p(exts)) {
+    mrb_int i;
+    for (i = 0; i < ARY_LEN(mrb_ary_ptr(exts)); i ++) {
+      VALUE ret = find_sysfile_trial(mrb, dir, file, ARY_PTR(mrb_ary_ptr(exts))[i], zext, withext);
+      if (!mrb_nil_p(ret)) { return ret; }
+    }
+
+    return Qnil;
+  }
+
+  mrb_check_type(mrb, exts, MRB_TT_STRING);
+
+  if (withext) {
+    if (!extname_p(RSTRING_PTR(file), RSTRING_LEN(file), RSTRING_PTR(exts), RSTRING_LEN(exts))) { return Qnil; }
+    return find_sysfile_candidate(mrb, dir, file, "", 0, zext, true);
+  } else {
+    return find_sysfile_candidate(mrb, dir, file, RSTRING_PTR(exts), RSTRING_LEN(exts), zext, false);
+  }
+}
+
+static VALUE
+ext_find_sysfile(MRB, VALUE self)
+{
+  VALUE dir, file, exts, zext = Qnil;
+  mrb_get_args(mrb, "SSo|o", &dir, &file, &exts, &zext);
+  if (!mrb_nil_p(zext)) { mrb_check_type(mrb, zext, MRB_TT_STRING); }
+
+  VALUE ret = find_sysfile_trial(mrb, dir, file, exts, zext, true);
+  if (mrb_nil_p(ret)) {
+    ret = find_sysfile_trial(mrb, dir, file, exts, zext, false);
+  }
+
+  return ret;
+}
+
+#ifndef SYSDIR_WITHOUT_FD
+/*
+ * Central.find_sysfiles のための候補。
+ *
+ * find_sysfile_trial() と同じ順に並べておき、ディレクトリの各項目と突き合わせる。
+ * `withext` であれば feature がすでに `ext` で終わる場合にだけ用いる。
+ */
+struct batch_candidate
+{
+  const char *ext;
+  size_t extlen;
+  char suffix[64];
+  size_t suffixlen;
+  bool withext;
+  bool compressed;
+};
+
+#define BATCH_CANDIDATES_MAX 64
+
+struct batch_feature
+{
+  const char *path;
+  size_t len;
+  size_t dirlen; /* 最後の区切り文字まで */
+  uint64_t matched;
+  bool grouped;
+};
+
+static bool
+batch_add_candidate(struct batch_candidate *cands, int *num, VALUE ext, VALUE zext, bool withext)
+{
+  int n;
+  for (n = 0; n < (mrb_string_p(zext) ? 2 : 1); n ++) {
+    if (*num >= BATCH_CANDIDATES_MAX) { return false; }
+    struct batch_candidate *c = &cands[(*num) ++];
+    c->ext = RSTRING_PTR(ext);
+    c->extlen = RSTRING_LEN(ext);
+    c->withext = withext;
+    c->compressed = (n > 0);
+    c->suffixlen = 0;
+    if (!withext) {
+      if (c->extlen >= sizeof(c->suffix)) { return false; }
+      memcpy(c->suffix, c->ext, c->extlen);
+      c->suffixlen = c->extlen;
+    }
+    if (c->compressed) {
+      if (c->suffixlen + RSTRING_LEN(zext) >= sizeof(c->suffix)) { return false; }
+      memcpy(c->suffix + c->suffixlen, RSTRING_PTR(zext), RSTRING_LEN(zext));
+      c->suffixlen += RSTRING_LEN(zext);
+    }
+  }
+
+  return true;
+}
+
+/*
+ * `groups` (`[[exts, zext], ...]`) から候補の一覧を作る。作れなければ偽を返す。
+ */
+static bool
+batch_make_candidates(MRB, VALUE groups, struct batch_candidate *cands, int *num)
+{
+  mrb_check_type(mrb, groups, MRB_TT_ARRAY);
+
+  mrb_int i, j, pass;
+  for (i = 0; i < RARRAY_LEN(groups); i ++) {
+    VALUE g = RARRAY_PTR(groups)[i];
+    mrb_check_type(mrb, g, MRB_TT_ARRAY);
+    if (RARRAY_LEN(g) != 2) { return false; }
+    VALUE exts = RARRAY_PTR(g)[0];
+    VALUE zext = RARRAY_PTR(g)[1];
+    if (!mrb_nil_p(zext)) { mrb_check_type(mrb, zext, MRB_TT_STRING); }
+
+    for (pass = 0; pass < 2; pass ++) {
+      if (mrb_string_p(exts)) {
+        if (!batch_add_candidate(cands, num, exts, zext, pass == 0)) { return false; }
+        continue;
+      }
+      mrb_check_type(mrb, exts, MRB_TT_ARRAY);
+      for (j = 0; j < RARRAY_LEN(exts); j ++) {
+        VALUE ext = RARRAY_PTR(exts)[j];
+        mrb_check_type(mrb, ext, MRB_TT_STRING);
+        if (!batch_add_candidate(cands, num, ext, zext, pass == 0)) { return false; }
+      }
+    }
+  }
+
+  return true;
+}
+
+/*
+ * ディレクトリの一覧と突き合わせられる feature であれば真を返す。
+ * 絶対パスや "." と ".." を含むもの、(大文字小文字や正規化の違いを吸収する macOS では) ASCII 以外を含むものは扱わない。
+ */
+static bool
+batch_feature_p(const char *path, size_t len)
+{
+  if (len < 1 || mrbx_pathsep_p(path[0]) || mrbx_pathsep_p(path[len - 1]) || memchr(path, '\0', len)) { return false; }
+
+  const char *p = path, *end = path + len;
+  while (p < end) {
+    const char *q = p;
+    while (q < end && !mrbx_pathsep_p(*q)) {
+#ifdef __APPLE__
+      if ((unsigned char)*q >= 0x80) { return false; }
+#endif
+      q ++;
+    }
+    if (q - p < 1 ||
+        (q - p == 1 && p[0] == '.') ||
+        (q - p == 2 && p[0] == '.' && p[1] == '.')) {
+      return false;
+    }
+    p = q + 1;
+  }
+
+  return true;
+}
+
+static bool
+batch_name_equal(const char *name, const char *base, size_t baselen, const char *suffix, size_t suffixlen)
+{
+  if (strlen(name) != baselen + suffixlen) { return false; }
+#ifdef __APPLE__
+  return strncasecmp(name, base, baselen) == 0 && strncasecmp(name + baselen, suffix, suffixlen) == 0;
+#else
+  return memcmp(name, base, baselen) == 0 && memcmp(name + baselen, suffix, suffixlen) == 0;
+#endif
+}
+
+/*
+ * 同じディレクトリにある feature (`head` から始まる) の一覧を一度だけ読み、候補と突き合わせる。
+ * ディレクトリが存在しなければ全て見つからないものとし、それ以外の理由で読めなければ偽を返す。
+ */
+static bool
+batch_scan_dir(const struct sysdir *sd, struct batch_feature *feats, size_t num, size_t head,
+               const struct batch_candidate *cands, int ncands)
+{
+  char buf[PATH_MAX];
+  const struct batch_feature *h = &feats[head];
+  const char *dirpath;
+  if (h->dirlen > 0) {
+    dirpath = sysdir_path(buf, sizeof(buf), sd, h->path, h->dirlen, "", 0);
+  } else if (sd->fd == AT_FDCWD) {
+    dirpath = make_syspath(buf, sizeof(buf), sd->prefix, sd->prefixlen, "", 0, "", 0);
+  } else {
+    dirpath = ".";
+  }
+  if (dirpath == NULL) { return false; }
+
+  int fd = sys_open(sd->fd, dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+  if (fd == -1) { return (errno == ENOENT || errno == ENOTDIR); }
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+    return false;
+  }
+
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    size_t i;
+    for (i = head; i < num; i ++) {
+      struct batch_feature *f = &feats[i];
+      if (f->dirlen != h->dirlen || memcmp(f->path, h->path, h->dirlen) != 0) { continue; }
+      const char *base = f->path + f->dirlen;
+      size_t baselen = f->len - f->dirlen;
+      int k;
+      for (k = 0; k < ncands; k ++) {
+        if (batch_name_equal(ent->d_name, base, baselen, cands[k].suffix, cands[k].suffixlen)) {
+          f->matched |= (uint64_t)1 << k;
+        }
+      }
+    }
+  }
+  closedir(dir);
+
+  return true;
+}
+
+/*
+ * call-seq:
+ *  find_sysfiles(dir, features, groups) -> array
+ *
+ * `dir` にある `features` をまとめて探す。
+ * `features` をディレクトリごとに分け、各ディレクトリの一覧を一度だけ読んで候補と突き合わせる。
+ * 一致した候補だけを、find_sysfile と同じ順に fstatat() で確かめる。
+ *
+ * 戻り値は `features` と同じ順に並んだ、見つかったパス (文字列) か nil の配列である。
+ * まとめて探せなかった feature は false となり、呼び出し側で一つずつ探す。
+ */
+static VALUE
+ext_find_sysfiles(MRB, VALUE self)
+{
+  VALUE dir, features, groups;
+  mrb_get_args(mrb, "SAA", &dir, &features, &groups);
+
+  struct batch_candidate cands[BATCH_CANDIDATES_MAX];
+  int ncands = 0;
+  struct sysdir sd;
+  if (!batch_make_candidates(mrb, groups, cands, &ncands) || !sysdir_get(mrb, dir, &sd)) {
+    return Qnil;
+  }
+
+  mrb_int num = RARRAY_LEN(features);
+  VALUE mob = mrbx_mob_create(mrb);
+  struct batch_feature *feats = (struct batch_feature *)mrbx_mob_malloc(mrb, mob, sizeof(struct batch_feature) * (num > 0 ? num : 1));
+  VALUE ret = mrb_ary_new_capa(mrb, num);
+  mrb_int i;
+  for (i = 0; i < num; i ++) {
+    VALUE f = RARRAY_PTR(features)[i];
+    mrb_check_type(mrb, f, MRB_TT_STRING);
+    mrb_ary_push(mrb, ret, mrb_false_value());
+    feats[i].path = RSTRING_PTR(f);
+    feats[i].len = RSTRING_LEN(f);
+    feats[i].matched = 0;
+    feats[i].grouped = !batch_feature_p(feats[i].path, feats[i].len);
+    mrbx_component_name cn = mrbx_split_path(feats[i].path, feats[i].len);
+    feats[i].dirlen = cn.basename - feats[i].path;
+  }
+
+  size_t max = mruby_require_plus_loadsize_max(mrb);
+  for (i = 0; i < num; i ++) {
+    if (feats[i].grouped) { continue; }
+
+    bool scanned = batch_scan_dir(&sd, feats, num, i, cands, ncands);
+
+    mrb_int j;
+    for (j = i; j < num; j ++) {
+      struct batch_feature *f = &feats[j];
+      if (f->grouped || f->dirlen != feats[i].dirlen || memcmp(f->path, feats[i].path, f->dirlen) != 0) { continue; }
+      f->grouped = true;
+      if (!scanned) { continue; }
+
+      VALUE found = Qnil;
+      int k;
+      for (k = 0; k < ncands && mrb_nil_p(found); k ++) {
+        const struct batch_candidate *c = &cands[k];
+        if (!(f->matched & ((uint64_t)1 << k))) { continue; }
+        if (c->withext && !extname_p(f->path, f->len, c->ext, c->extlen)) { continue; }
+        mrb_int size = sysfile_size(&sd, f->path, f->len, c->suffix, c->suffixlen, c->compressed);
+        if (size < 0 || (size_t)size >= max) { continue; }
+        found = mrb_str_new(mrb, NULL, f->len + c->suffixlen);
+        memcpy(RSTRING_PTR(found), f->path, f->len);
+        memcpy(RSTRING_PTR(found) + f->len, c->suffix, c->suffixlen);
+      }
+      mrb_ary_set(mrb, ret, j, found);
+    }
+  }
+
+  mrbx_mob_cleanup(mrb, mob);
+
+  return ret;
+}
+#else
+static VALUE
+ext_find_sysfiles(MRB, VALUE self)
+{
+  return Qnil;
+}
+#endif
+
+static VALUE
+ext_sysfile_size(MRB, VALUE self)
+{
+  VALUE dir, path;
+  mrb_get_args(mrb, "SS", &dir, &path);
+
+  struct sysdir sd;
+  if (!sysdir_get(mrb, dir, &sd)) { return Qnil; }
+  mrb_int size = sysfile_size(&sd, RSTRING_PTR(path), RSTRING_LEN(path), "", 0, false);
+  return (size < 0 ? Qnil : mrb_fixnum_value(size));
+}
+
+static bool
+sysfile_stat(MRB, VALUE dir, VALUE path, struct stat *st)
+{
+  char buf[PATH_MAX];
+  struct sysdir sd;
+  return sysdir_get(mrb, dir, &sd) &&
+         sysdir_path(buf, sizeof(buf), &sd, RSTRING_PTR(path), RSTRING_LEN(path), "", 0) != NULL &&
+         sys_stat(sd.fd, buf, st) == 0;
+}
+
+/*
+ * ファイルの実体を識別するための文字列 (デバイス番号と i-node 番号) を返す。
+ */
+static VALUE
+sysfile_identity(MRB, const struct stat *st)
+{
+  char buf[64];
+  int len = snprintf(buf, sizeof(buf), "file:%llx:%llx", (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+  return mrb_str_new(mrb, buf, len);
+}
+
+/*
+ * `Kernel#load` の結果を再利用するために、ファイルの大きさと更新時刻、実体の識別子 (Central.sysfile_identity と同じ) を
+ * `[size, sec, nsec, identity]` として返す。
+ * 大きさと更新時刻が同じ別のファイルに置き換えられた場合も、識別子によって区別される。
+ */
+static VALUE
+ext_sysfile_stamp(MRB, VALUE self)
+{
+  VALUE dir, path;
+  mrb_get_args(mrb, "SS", &dir, &path);
+
+  struct stat st;
+  if (!sysfile_stat(mrb, dir, path, &st)) { return Qnil; }
+
+#if defined(__APPLE__)
+  long nsec = st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  long nsec = 0;
+#else
+  long nsec = st.st_mtim.tv_nsec;
+#endif
+
+  return MRBX_TUPLE(mrb_fixnum_value((mrb_int)clamp(st.st_size, 0, MRB_INT_MAX)),
+                    mrb_fixnum_value((mrb_int)st.st_mtime),
+                    mrb_fixnum_value((mrb_int)nsec),
+                    sysfile_identity(mrb, &st));
+}
+
+/*
+ * 現在の作業ディレクトリを返す。取得できなければ nil を返す。
+ */
+static VALUE
+ext_getcwd(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+
+  char buf[PATH_MAX];
+  if (getcwd(buf, sizeof(buf)) == NULL) { return Qnil; }
+  return mrb_str_new_cstr(mrb, buf);
+}
+
+static VALUE
+ext_sysfile_identity(MRB, VALUE self)
+{
+  VALUE dir, path;
+  mrb_get_args(mrb, "SS", &dir, &path);
+
+  struct stat st;
+  if (!sysfile_stat(mrb, dir, path, &st)) { return Qnil; }
+  return sysfile_identity(mrb, &st);
+}
+
+/*
+ * ファイルの内容を読み込む。
+ *
+ * ファイルが存在しなければ nil を返し、それ以外の理由で読み込めなかった場合は LoadError 例外を発生させる。
+ */
+static VALUE
+ext_sysfile_read(MRB, VALUE self)
+{
+  VALUE dir, path;
+  mrb_get_args(mrb, "SS", &dir, &path);
+
+  char buf[PATH_MAX];
+  struct sysdir sd;
+  if (!sysdir_get(mrb, dir, &sd) ||
+      sysdir_path(buf, sizeof(buf), &sd, RSTRING_PTR(path), RSTRING_LEN(path), "", 0) == NULL) {
+    return Qnil;
+  }
+
+  int fd = sys_open(sd.fd, buf, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1) {
+    if (errno == ENOENT || errno == ENOTDIR) { return Qnil; }
+    goto failed;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = EISDIR;
+    goto failed;
+  }
+  if ((uint64_t)st.st_size >= mruby_require_plus_loadsize_max(mrb)) {
+    close(fd);
+    mrb_raisef(mrb, E_LOAD_ERROR, "too large file - %S", mrb_str_new_cstr(mrb, buf));
+  }
+
+  VALUE str = mrb_str_new(mrb, NULL, (mrb_int)st.st_size);
+  size_t off = 0;
+  while (off < (size_t)st.st_size) {
+    ssize_t n = read(fd, RSTRING_PTR(str) + off, st.st_size - off);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      goto failed;
+    }
+    if (n == 0) { break; }
+    off += n;
+  }
+  close(fd);
+  RSTR_SET_LEN(mrb_str_ptr(str), off);
+
+  return str;
+
+failed:
+  {
+    VALUE mesg = mrb_str_new_cstr(mrb, strerror(errno));
+    mrb_raisef(mrb, E_LOAD_ERROR, "failed read - %S (%S)", mrb_str_new_cstr(mrb, buf), mesg);
+  }
+  return Qnil; /* not reached */
+}
+
+/*
+ * `path` の一時ファイルを作成して、そのファイル記述子を返す (`tmp` にはその名前を格納する)。
+ *
+ * 名前にはプロセス番号と、呼び出しごとに変わる値を含める。
+ * 同じ名前が既にあれば作り直すため、複数のスレッドや mrb_state から同時に書き込まれても取り違えない。
+ */
+static int
+sysfile_mktemp(int dirfd, const char *path, char *tmp, size_t tmpsize)
+{
+  static unsigned long serial = 0;
+  int i;
+
+  for (i = 0; i < 100; i ++) {
+    if (snprintf(tmp, tmpsize, "%s.%ld.%lx.%lx.tmp",
+                 path, (long)getpid(), (unsigned long)time(NULL), ++ serial) >= (int)tmpsize) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    int fd = sys_open(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd != -1 || errno != EEXIST) { return fd; }
+  }
+
+  return -1;
+}
+
+/*
+ * `data` をファイルに書き込む。
+ *
+ * 一時ファイルに書き込んでから名前を変えるため、読み込み側が書きかけの内容を見ることはない。
+ * `dir` が存在しなければ作成する (親ディレクトリまでは作成しない)。
+ * 他の利用者が読み書きできないように、ディレクトリは 0700、ファイルは 0600 で作成する。
+ * 書き込めなかった場合は false を返す。
+ */
+static VALUE
+ext_sysfile_write(MRB, VALUE self)
+{
+  VALUE dir, path, data;
+  mrb_get_args(mrb, "SSS", &dir, &path, &data);
+
+  char buf[PATH_MAX], tmp[PATH_MAX];
+  struct sysdir sd;
+  if (make_syspath(buf, sizeof(buf), RSTRING_PTR(dir), RSTRING_LEN(dir), "", 0, "", 0) == NULL) {
+    return mrb_false_value();
+  }
+  mkdir(buf, 0700);
+
+  if (!sysdir_get(mrb, dir, &sd) ||
+      sysdir_path(buf, sizeof(buf), &sd, RSTRING_PTR(path), RSTRING_LEN(path), "", 0) == NULL) {
+    return mrb_false_value();
+  }
+
+  int fd = sysfile_mktemp(sd.fd, buf, tmp, sizeof(tmp));
+  if (fd == -1) { return mrb_false_value(); }
+
+  const char *p = RSTRING_PTR(data);
+  size_t off = 0, size = RSTRING_LEN(data);
+  while (off < size) {
+    ssize_t n = write(fd, p + off, size - off);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { break; }
+    off += n;
+  }
+
+  if (close(fd) != 0 || off < size || sys_rename(sd.fd, tmp, buf) != 0) {
+    sys_unlink(sd.fd, tmp);
+    return mrb_false_value();
+  }
+
+  return mrb_true_value();
+}
+
+/*
+ * SHA-256 (FIPS 180-4)
+ *
+ * CachingVFS が内容の名前と検証に用いる。同じ名前の別の内容を取り違えないように、衝突困難なものを用いる。
+ */
+struct sha256
+{
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  size_t blocklen;
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static void
+sha256_compress(struct sha256 *c, const uint8_t *p)
+{
+  uint32_t w[64], s[8];
+  int i;
+
+  for (i = 0; i < 16; i ++) {
+    w[i] = loadu32be(p + i * 4);
+  }
+  for (; i < 64; i ++) {
+    uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  memcpy(s, c->state, sizeof(s));
+  for (i = 0; i < 64; i ++) {
+    uint32_t t1 = s[7] + (SHA256_ROTR(s[4], 6) ^ SHA256_ROTR(s[4], 11) ^ SHA256_ROTR(s[4], 25)) +
+                  ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+    uint32_t t2 = (SHA256_ROTR(s[0], 2) ^ SHA256_ROTR(s[0], 13) ^ SHA256_ROTR(s[0], 22)) +
+                  ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+    memmove(s + 1, s, sizeof(uint32_t) * 7);
+    s[4] += t1;
+    s[0] = t1 + t2;
+  }
+
+  for (i = 0; i < 8; i ++) {
+    c->state[i] += s[i];
+  }
+}
+
+static void
+sha256_init(struct sha256 *c)
+{
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
 
-    if (init) {
-      init(mrb);
-      mrb_gc_arena_restore(mrb, ai);
-      mrb_gc_protect(mrb, mob);
+  memcpy(c->state, iv, sizeof(iv));
+  c->length = 0;
+  c->blocklen = 0;
+}
+
+static void
+sha256_update(struct sha256 *c, const void *data, size_t size)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  c->length += size;
+
+  while (size > 0) {
+    size_t n = 64 - c->blocklen;
+    if (n > size) { n = size; }
+    memcpy(c->block + c->blocklen, p, n);
+    c->blocklen += n;
+    p += n;
+    size -= n;
+    if (c->blocklen == 64) {
+      sha256_compress(c, c->block);
+      c->blocklen = 0;
     }
+  }
+}
 
-    if (irepbin) {
-      mrb_irep *irep = mrb_read_irep(mrb, (const uint8_t *)irepbin);
-      mrbx_mob_push(mrb, mob, irep, (mrbx_mob_free_f *)mrb_irep_decref);
-      struct RProc *proc = mrb_proc_new(mrb, irep);
-      mrbx_mob_pop(mrb, mob, irep);
-      mrbx_mob_cleanup(mrb, mob);
+static void
+sha256_final(struct sha256 *c, uint8_t digest[32])
+{
+  uint64_t bits = c->length * 8;
+  uint8_t pad[72];
+  size_t padlen = (c->blocklen < 56 ? 56 : 120) - c->blocklen;
+  int i;
+
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i ++) {
+    pad[padlen + i] = (uint8_t)(bits >> (56 - i * 8));
+  }
+  sha256_update(c, pad, padlen + 8);
 
-      mrb_gc_arena_restore(mrb, ai);
-      mrb_gc_protect(mrb, VALUE(proc));
-      aux_exec_proc_on_toplevel(mrb, proc);
-    } else {
-      mrbx_mob_cleanup(mrb, mob);
-    }
+  for (i = 0; i < 8; i ++) {
+    digest[i * 4 + 0] = (uint8_t)(c->state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(c->state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(c->state[i] >>  8);
+    digest[i * 4 + 3] = (uint8_t)(c->state[i] >>  0);
+  }
+}
 
-    mrb_gc_arena_restore(mrb, ai);
+/*
+ * 文字列の SHA-256 を 64 桁の十六進数文字列として返す。
+ */
+static VALUE
+ext_hexdigest(MRB, VALUE self)
+{
+  VALUE str;
+  mrb_get_args(mrb, "S", &str);
+
+  struct sha256 c;
+  uint8_t digest[32];
+  sha256_init(&c);
+  sha256_update(&c, RSTRING_PTR(str), RSTRING_LEN(str));
+  sha256_final(&c, digest);
+
+  static const char hex[] = "0123456789abcdef";
+  char buf[64];
+  int i;
+  for (i = 0; i < 32; i ++) {
+    buf[i * 2 + 0] = hex[digest[i] >> 4];
+    buf[i * 2 + 1] = hex[digest[i] & 0x0f];
+  }
+  return mrb_str_new(mrb, buf, sizeof(buf));
+}
 
-    return Qnil;
+static VALUE
+ext_extname_p(MRB, VALUE self)
+{
+  VALUE path, ext;
+  mrb_get_args(mrb, "SS", &path, &ext);
+  return mrb_bool_value(extname_p(RSTRING_PTR(path), RSTRING_LEN(path), RSTRING_PTR(ext), RSTRING_LEN(ext)));
+}
+
+/*
+ * `$"` に `signature` が含まれているかどうかを返す。
+ *
+ * `Array#include?` はブロックを伴うため、環境オブジェクトの複製でメモリを確保することがある。
+ * 読み込み済みの feature に対する `require` を、メモリ確保なしで済ませるために用いる。
+ */
+static VALUE
+ext_loaded_p(MRB, VALUE self)
+{
+  VALUE signature;
+  mrb_get_args(mrb, "S", &signature);
+
+  VALUE features = mrb_gv_get(mrb, SYMBOL("$\""));
+  if (!mrb_array_p(features)) { return mrb_false_value(); }
+
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(features); i ++) {
+    VALUE f = RARRAY_PTR(features)[i];
+    if (mrb_string_p(f) && mrb_str_equal(mrb, f, signature)) {
+      return mrb_true_value();
+    }
   }
 
-raise_exc:
-  mrbx_mob_cleanup(mrb, mob);
-  mrb_gc_arena_restore(mrb, ai);
-  mrb_raisef(mrb, E_LOAD_ERROR, "failed load %S (in %S)", name, vfs);
-  return Qnil; /* not reached */
+  return mrb_false_value();
 }
 
+/*
+ * 圧縮されたファイルを展開する。
+ *
+ * 展開後のバイト数はヘッダに記録されているため、展開する前に loadsize_max と比較できる。
+ */
 static VALUE
-joinpath(MRB, VALUE str, mrb_int argc, const VALUE argv[], bool *istermsep)
+ext_inflate(MRB, VALUE self)
 {
-  /* FIXME: Windows だと ["C:", "/file"] の場合に "C:file" となってしまう */
+  VALUE name, src;
+  mrb_get_args(mrb, "SS", &name, &src);
+
+  const uint8_t *p = (const uint8_t *)RSTRING_PTR(src);
+  size_t len = RSTRING_LEN(src);
+  int64_t size = mruby_require_plus_zheader_size(p, len);
+  if (size < 0) {
+    mrb_raisef(mrb, E_LOAD_ERROR, "wrong compressed file - %S", name);
+  }
+  if ((uint64_t)size >= mruby_require_plus_loadsize_max(mrb)) {
+    mrb_raisef(mrb, E_LOAD_ERROR, "too large file - %S", name);
+  }
 
-  for (; argc > 0; argc --, argv ++) {
-    VALUE tmp = *argv;
+  VALUE dest = mrb_str_new(mrb, NULL, (mrb_int)size);
+  if (!mruby_require_plus_zdecode(p + MRUBY_REQUIRE_PLUS_ZHEADER_SIZE, len - MRUBY_REQUIRE_PLUS_ZHEADER_SIZE,
+                                  RSTRING_PTR(dest), (size_t)size)) {
+    mrb_raisef(mrb, E_LOAD_ERROR, "broken compressed file - %S", name);
+  }
 
-    switch (mrb_type(tmp)) {
-    default:
-      tmp = mrb_funcall_argv(mrb, tmp, SYMBOL("to_path"), 0, NULL);
-      mrb_check_type(mrb, tmp, MRB_TT_STRING);
-      /* fall through */
-    case MRB_TT_STRING:
-      {
-        const char *s = RSTRING_PTR(tmp);
-        mrb_int slen = RSTRING_LEN(tmp);
+  return dest;
+}
 
-        if (mrb_nil_p(str)) {
-          str = mrb_str_new(mrb, s, slen);
-          *istermsep = !mrbx_need_pathsep_p(s, slen);
-        } else if (slen > 0) {
-          if (!(!!*istermsep ^ !!mrbx_pathsep_p(s[0]))) {
-            /* 末尾が "/" で終わっておりかつ追加しようとしている文字列が "/" で始まる場合、
-             * あるいは連結する時に "/" を必要とする場合は処理する */
-            if (*istermsep) {
-              s ++;
-              slen --;
-            } else {
-              mrb_str_cat_cstr(mrb, str, "/");
-            }
-          }
+#define DEFAULT_LOADSIZE_MAX     ( 4 << 20) //  4 MiB (default)
+#define DEFAULT_LOADSIZE_MINIMUM (16 << 10) // 16 KiB
+#define DEFAULT_LOADSIZE_MAXIMUM (64 << 20) // 64 MiB
 
-          if (slen > 0) {
-            *istermsep = mrbx_pathsep_p(s[slen - 1]);
-            mrb_str_cat(mrb, str, s, slen);
-          }
-        }
-      }
+#define id_loadsize_max SYMBOL("loadsize_max@require+")
 
-      break;
-    case MRB_TT_ARRAY:
-      str = joinpath(mrb, str, ARY_LEN(mrb_ary_ptr(tmp)), ARY_PTR(mrb_ary_ptr(tmp)), istermsep);
-      break;
-    }
+MRB_API size_t
+mruby_require_plus_loadsize_max(MRB)
+{
+  VALUE v = mrb_gv_get(mrb, id_loadsize_max);
+  if (mrb_float_p(v)) {
+    return mrb_float(v);
+  } else {
+    return mrb_int(mrb, v);
   }
+}
 
-  return str;
+MRB_API void
+mruby_require_plus_set_loadsize_max(MRB, size_t bytesize)
+{
+  VALUE v;
+  bytesize = clamp(bytesize, DEFAULT_LOADSIZE_MINIMUM, DEFAULT_LOADSIZE_MAXIMUM);
+  if (bytesize > MRB_INT_MAX) {
+    v = mrb_float_value(mrb, bytesize);
+  } else {
+    v = mrb_fixnum_value(bytesize);
+  }
+  mrb_gv_set(mrb, id_loadsize_max, v);
 }
 
-static bool
-split_frame_info(const char *info, const size_t len, const char **pathterm, int *line)
+/*
+ * 単調増加する時刻を秒単位で返す。読み込み時間の計測に用いる。
+ */
+static double
+monotonic_clock(void)
 {
-  const char *beg = info;
-  const uintptr_t end = (uintptr_t)info + len;
-  const char *path;
-  int linenum;
-  *pathterm = NULL;
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+    return 0.0;
+  }
 
-retry:
-  for (;; info ++) {
-    if (end - (uintptr_t)info <= 0 || *info == '\0') {
-      return *pathterm != NULL && *pathterm - beg > 0;
-    } else if (*info == ':') {
-      path = info ++;
-      break;
-    }
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static VALUE
+ext_clock(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  return mrb_float_value(mrb, (mrb_float)monotonic_clock());
+}
+
+/*
+ * 起動時の一括読み込みのための状態。
+ *
+ * 読み込まれるオブジェクトのほとんどは生き残るため、その間の GC は無駄な走査となる。
+ * boot_begin から boot_end までの間は GC を止め、最後に一度だけ完全な GC を行う。
+ * GC を止めている間はアリーナの復帰も GC を伴わないため、アリーナの大きさを変える必要はない。
+ */
+struct boot_state
+{
+  int depth;
+  bool gc_disabled;     /* boot_begin する前の状態 */
+  double start;
+  double last_elapsed;  /* 直前の boot_begin から boot_end までの時間 (最後の GC を含む) */
+  double last_gc_time;  /* 直前の boot_end で行った GC の時間 */
+  double total_gc_time;
+  int64_t boots;
+};
+
+static const mrb_data_type boot_state_type = { "boot@require+", mrb_free };
+
+#define id_boot_state SYMBOL("boot@require+")
+
+static struct boot_state *
+get_boot_state(MRB)
+{
+  return (struct boot_state *)mrb_data_get_ptr(mrb, mrb_gv_get(mrb, id_boot_state), &boot_state_type);
+}
+
+MRB_API void
+mruby_require_plus_boot_begin(MRB)
+{
+  struct boot_state *p = get_boot_state(mrb);
+  if (p == NULL) { return; }
+
+  if (p->depth ++ > 0) { return; }
+
+  p->gc_disabled = AUX_GC_DISABLED(mrb);
+  p->start = monotonic_clock();
+  AUX_GC_DISABLED(mrb) = TRUE;
+}
+
+MRB_API void
+mruby_require_plus_boot_end(MRB)
+{
+  struct boot_state *p = get_boot_state(mrb);
+  if (p == NULL || p->depth < 1) { return; }
+
+  if (-- p->depth > 0) { return; }
+
+  AUX_GC_DISABLED(mrb) = p->gc_disabled;
+
+  double t = monotonic_clock();
+  if (!p->gc_disabled) {
+    mrb_full_gc(mrb);
   }
+  double now = monotonic_clock();
 
-retry_line:
-  if (end - (uintptr_t)info <= 0 || !isdigit((uint8_t)*info)) {
-    goto retry;
+  p->last_gc_time = now - t;
+  p->last_elapsed = now - p->start;
+  p->total_gc_time += p->last_gc_time;
+  p->boots ++;
+}
+
+static VALUE
+ext_boot_begin(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  mruby_require_plus_boot_begin(mrb);
+  return Qnil;
+}
+
+static VALUE
+ext_boot_end(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  mruby_require_plus_boot_end(mrb);
+  return Qnil;
+}
+
+static VALUE
+rp_boot_stats(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+
+  struct boot_state *p = get_boot_state(mrb);
+  if (p == NULL) { return Qnil; }
+
+  VALUE stats = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("boots")), mrb_fixnum_value((mrb_int)p->boots));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("active")), mrb_bool_value(p->depth > 0));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("last_elapsed")), mrb_float_value(mrb, p->last_elapsed));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("last_gc_time")), mrb_float_value(mrb, p->last_gc_time));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("total_gc_time")), mrb_float_value(mrb, p->total_gc_time));
+
+  return stats;
+}
+
+static VALUE
+rp_loadsize_max(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  return mrb_gv_get(mrb, id_loadsize_max);
+}
+
+/*
+ * irep のパック。
+ *
+ * 読み込み済みの irep の命令列と文字列リテラルの本体を、mmap() した専用のページ (パック領域) へ詰め直し、
+ * 読み込み専用にする。GC やメモリ確保による書き込みが及ばないため、fork() した子プロセスとの共有が保たれる。
+ *
+ * mrb_irep_free() は irep 本体・pool 配列・pool の RString 構造体を必ず mrb_free() するため、これらは移せない。
+ * 移すのは解放を抑止できる命令列 (MRB_ISEQ_NO_FREE) と、共有されていない文字列リテラルの本体 (MRB_STR_NOFREE) だけである。
+ * 一度でも実行された文字列リテラルは mrb_str_dup() によって共有状態となり、その管理構造は公開されていないため移せない。
+ * 実行中のフレームが参照している irep の命令列は、戻り番地が指しているため移さない。
+ */
+#if defined(HAVE_MMAP) && defined(MRB_ISEQ_NO_FREE) && MRUBY_RELEASE_NO >= 20000
+# define HAVE_PACK_ARENA 1
+#endif
+
+#ifdef HAVE_PACK_ARENA
+struct pack_chunk
+{
+  struct pack_chunk *next;
+  size_t size;
+  size_t used;
+};
+
+#define PACK_CHUNK_SIZE ((size_t)64 << 10)
+#define PACK_ALIGN(N) (((N) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static void
+pack_arena_free(MRB, void *ptr)
+{
+  struct pack_chunk *c = (struct pack_chunk *)ptr;
+  while (c) {
+    struct pack_chunk *next = c->next;
+    munmap(c, c->size);
+    c = next;
   }
+}
 
-  linenum = 0;
-  for (;; info ++) {
-    if (end - (uintptr_t)info <= 0 || *info == '\0') {
-      if (linenum > 0) {
-        *pathterm = path;
-        *line = linenum;
-        return *pathterm - beg > 0;
-      } else {
-        return false;
-      }
-    } else if (*info == ':') {
-      info ++;
-      break;
-    } else if (!isdigit((uint8_t)*info)) {
-      goto retry;
-    } else {
-      linenum = linenum * 10 + digittoint((uint8_t)*info);
-    }
+static const mrb_data_type pack_arena_type = { "pack arena@require+", pack_arena_free };
+
+#define id_pack_arena SYMBOL("pack arena@require+")
+
+struct pack_state
+{
+  struct pack_chunk *chunks; /* 今回確保したもの */
+  const mrb_irep **ireps;
+  size_t nireps, irepcapa;
+  const mrb_irep **busy;
+  size_t nbusy, busycapa;
+  struct mrb_context **cxts;
+  size_t ncxts, cxtcapa;
+};
+
+/*
+ * 作業用の配列に追加する。GC を誘発しないように realloc() を用いる。
+ */
+static bool
+pack_list_add(void *listp, size_t *num, size_t *capa, void *ptr)
+{
+  void ***list = (void ***)listp;
+  if (*num >= *capa) {
+    size_t newcapa = (*capa < 64 ? 64 : *capa * 2);
+    void **p = (void **)realloc(*list, newcapa * sizeof(void *));
+    if (p == NULL) { return false; }
+    *list = p;
+    *capa = newcapa;
   }
+  (*list)[(*num) ++] = ptr;
+  return true;
+}
 
-  if (end - (uintptr_t)info < 3 ||
-      info[0] != 'i' || info[1] != 'n' || info[2] != ' ') {
-    path = info - 1;
-    goto retry_line;
+static void *
+pack_alloc(struct pack_state *st, size_t size)
+{
+  struct pack_chunk *c = st->chunks;
+  size = PACK_ALIGN(size);
+  if (c == NULL || c->size - c->used < size) {
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t chunksize = max(PACK_CHUNK_SIZE, PACK_ALIGN(sizeof(struct pack_chunk)) + size);
+    chunksize = (chunksize + pagesize - 1) / pagesize * pagesize;
+    void *p = mmap(NULL, chunksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { return NULL; }
+    c = (struct pack_chunk *)p;
+    c->next = st->chunks;
+    c->size = chunksize;
+    c->used = PACK_ALIGN(sizeof(struct pack_chunk));
+    st->chunks = c;
   }
-  info += 3;
 
-  for (;; info ++) {
-    if (end - (uintptr_t)info <= 0 || *info == '\0') {
-      *pathterm = path;
-      *line = linenum;
-      return *pathterm - beg > 0;
-    } else if (*info == ':') {
-      *pathterm = path;
-      *line = linenum;
-      path = info ++;
-      goto retry_line;
+  void *p = (char *)c + c->used;
+  c->used += size;
+  return p;
+}
+
+#ifdef MRB_EACH_OBJ_OK
+static int
+#else
+static void
+#endif
+pack_collect(MRB, struct RBasic *obj, void *data)
+{
+  struct pack_state *st = (struct pack_state *)data;
+
+  if (obj->tt == MRB_TT_PROC) {
+    struct RProc *proc = (struct RProc *)obj;
+    if (!MRB_PROC_CFUNC_P(proc) && proc->body.irep) {
+      pack_list_add(&st->ireps, &st->nireps, &st->irepcapa, proc->body.irep);
+    }
+  } else if (obj->tt == MRB_TT_FIBER) {
+    struct RFiber *fib = (struct RFiber *)obj;
+    if (fib->cxt && fib->cxt != mrb->root_c) {
+      pack_list_add(&st->cxts, &st->ncxts, &st->cxtcapa, fib->cxt);
     }
   }
+
+#ifdef MRB_EACH_OBJ_OK
+  return MRB_EACH_OBJ_OK;
+#endif
 }
 
-static VALUE
-split_frame_info_value(MRB, VALUE frame)
+static void
+pack_collect_busy(struct pack_state *st, const struct mrb_context *c)
 {
-  mrb_check_type(mrb, frame, MRB_TT_STRING);
-  const char *info = RSTRING_PTR(frame);
-  size_t len = RSTRING_LEN(frame);
-  const char *pathterm;
-  int line;
+  if (c == NULL || c->cibase == NULL) { return; }
 
-  if (!split_frame_info(info, len, &pathterm, &line)) {
-    return Qnil;
+  const mrb_callinfo *ci;
+  for (ci = c->cibase; ci <= c->ci; ci ++) {
+    if (ci->proc && !MRB_PROC_CFUNC_P(ci->proc)) {
+      pack_list_add(&st->busy, &st->nbusy, &st->busycapa, ci->proc->body.irep);
+    }
   }
-
-  return MRBX_TUPLE(mrb_str_new(mrb, info, pathterm - info), mrb_fixnum_value(line));
 }
 
-static VALUE
-ext_split_frame_info(MRB, VALUE self)
+static bool
+pack_busy_p(const struct pack_state *st, const mrb_irep *irep)
 {
-  mrb_get_args(mrb, "");
-  return split_frame_info_value(mrb, self);
+  size_t i;
+  for (i = 0; i < st->nbusy; i ++) {
+    if (st->busy[i] == irep) { return true; }
+  }
+  return false;
 }
 
-static VALUE
-ext_get_upper_frame(MRB, VALUE self)
+static void
+pack_irep(MRB, struct pack_state *st, mrb_irep *irep)
 {
-  mrb_get_args(mrb, "");
-  VALUE bt = mrb_get_backtrace(mrb);
-  VALUE uf = mrb_ary_ref(mrb, bt, 1);
-  if (!mrb_string_p(uf)) { return Qnil; }
-  return split_frame_info_value(mrb, uf);
+  if (irep->flags & MRB_ISEQ_NO_FREE) { return; } /* パック済み、あるいは静的なバイナリを参照している */
+
+  int i;
+  for (i = 0; i < irep->plen; i ++) {
+    if (!mrb_string_p(irep->pool[i])) { continue; }
+    struct RString *str = RSTRING(irep->pool[i]);
+    if (RSTR_EMBED_P(str) || RSTR_SHARED_P(str) || RSTR_FSHARED_P(str) || RSTR_NOFREE_P(str)) { continue; }
+
+    mrb_int len = RSTR_LEN(str);
+    char *body = (char *)pack_alloc(st, len + 1);
+    if (body == NULL) { return; }
+    memcpy(body, str->as.heap.ptr, len);
+    body[len] = '\0';
+    mrb_free(mrb, str->as.heap.ptr);
+    str->as.heap.ptr = body;
+    str->as.heap.aux.capa = len;
+    RSTR_SET_NOFREE_FLAG(str);
+  }
+
+  if (!pack_busy_p(st, irep) && irep->ilen > 0) {
+    size_t size = sizeof(mrb_code) * irep->ilen;
+    mrb_code *iseq = (mrb_code *)pack_alloc(st, size);
+    if (iseq == NULL) { return; }
+    memcpy(iseq, irep->iseq, size);
+    mrb_free(mrb, (void *)irep->iseq);
+    irep->iseq = iseq;
+    irep->flags |= MRB_ISEQ_NO_FREE;
+  }
+
+  for (i = 0; i < irep->rlen; i ++) {
+    if (irep->reps[i]) { pack_irep(mrb, st, irep->reps[i]); }
+  }
 }
 
-static VALUE
-ext_makepath(MRB, VALUE self)
+/*
+ * GC を完全に行った上で、到達可能な irep をパックする。
+ */
+static void
+pack_ireps(MRB)
 {
-  mrb_int argc;
-  VALUE *argv;
+  VALUE arena = mrb_gv_get(mrb, id_pack_arena);
+  mrb_data_check_type(mrb, arena, &pack_arena_type);
 
-  switch (mrb_get_args(mrb, "*", &argv, &argc)) {
-  case 0:
-    return mrb_str_new(mrb, NULL, 0);
-  case 1:
-    return mrb_to_str(mrb, argv[0]);
+  struct pack_state st = { NULL };
+  mrb_objspace_each_objects(mrb, pack_collect, &st);
+
+  size_t i;
+  pack_collect_busy(&st, mrb->root_c);
+  pack_collect_busy(&st, mrb->c);
+  for (i = 0; i < st.ncxts; i ++) {
+    pack_collect_busy(&st, st.cxts[i]);
   }
 
-  bool istermsep = false;
+  for (i = 0; i < st.nireps; i ++) {
+    pack_irep(mrb, &st, (mrb_irep *)st.ireps[i]);
+  }
 
-  return joinpath(mrb, Qnil, argc, argv, &istermsep);
+  /*
+   * 今回のチャンクは以後書き込まないため、読み込み専用として既存の一覧へ繋ぐ。
+   */
+  while (st.chunks) {
+    struct pack_chunk *c = st.chunks;
+    st.chunks = c->next;
+    c->next = (struct pack_chunk *)DATA_PTR(arena);
+    DATA_PTR(arena) = c;
+    mprotect(c, c->size, PROT_READ);
+  }
+
+  free(st.ireps);
+  free(st.busy);
+  free(st.cxts);
+}
+
+/*
+ * パック領域が占める仮想アドレスであれば真を返す。
+ */
+static bool
+pack_arena_include_p(MRB, uintptr_t start, uintptr_t end)
+{
+  const struct pack_chunk *c = (const struct pack_chunk *)mrb_data_check_get_ptr(mrb, mrb_gv_get(mrb, id_pack_arena), &pack_arena_type);
+  for (; c; c = c->next) {
+    uintptr_t p = (uintptr_t)c;
+    if (p < end && start < p + c->size) { return true; }
+  }
+  return false;
 }
+#endif /* HAVE_PACK_ARENA */
 
+/*
+ * fork() する前にヒープを落ち着かせる。
+ *
+ * 構文解析やコード生成の一時領域は、ファイルごとに mrb_parser_free() で解放済みである。
+ * ここでは GC を完全に行い、irep をパック領域へ移してから、解放された領域を可能であれば OS へ返却する。
+ * こうすることで、fork() 後の子プロセスで書き込まれる (共有が解かれる) ページを減らす。
+ */
 static VALUE
-ext_dirname(MRB, VALUE self)
+rp_settle_heap(MRB, VALUE self)
 {
-  VALUE arg0;
-  mrb_get_args(mrb, "S", &arg0);
-  const char *path = RSTRING_PTR(arg0);
-  size_t len = RSTRING_LEN(arg0);
-  mrbx_component_name cn = mrbx_split_path(path, len);
+  mrb_get_args(mrb, "");
 
-  if (cn.dirterm == path) {
-    return mrb_str_new_lit(mrb, ".");
+  workers_join(mrb);
+#ifdef HAVE_PACK_ARENA
+  pack_ireps(mrb); /* mrb_objspace_each_objects() が GC を完全に行う */
+#else
+  mrb_full_gc(mrb);
+#endif
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim(0);
+#endif
+
+  return Qnil;
+}
+
+static VALUE
+size_value(MRB, double size)
+{
+  if (size > MRB_INT_MAX) {
+    return mrb_float_value(mrb, size);
   } else {
-    return mrb_str_new(mrb, path, cn.dirterm - path);
+    return mrb_fixnum_value((mrb_int)size);
   }
 }
 
+/*
+ * 現在のプロセスの共有ページ・私有ページのバイト数を取得する。
+ * packed_shared と packed_private はパック領域だけを集計したものである。
+ * 取得できない環境では nil を返す。
+ */
 static VALUE
-ext_basename(MRB, VALUE self)
+rp_memory_pages(MRB, VALUE self)
 {
-  VALUE arg0, arg1 = Qnil;
-  mrb_get_args(mrb, "S|S", &arg0, &arg1);
-  const char *path = RSTRING_PTR(arg0);
-  size_t len = RSTRING_LEN(arg0);
-  mrbx_component_name cn = mrbx_split_path(path, len);
+  mrb_get_args(mrb, "");
 
-  if (cn.nameterm == path) {
-    return mrb_str_new_lit(mrb, ".");
-  } else if (!mrb_nil_p(arg1)) {
-    if (strcmp(".*", RSTRING_PTR(arg1)) == 0 ||
-        strncmp(cn.extname, RSTRING_PTR(arg1), cn.nameterm - cn.extname) == 0) {
-      return mrb_str_new(mrb, cn.basename, cn.extname - cn.basename);
+#ifdef __linux__
+  static const struct {
+    const char *field;
+    const char *key;
+    int packed; /* 1: shared, 2: private */
+  } fields[] = {
+    { "Rss:", "rss", 0 },
+    { "Shared_Clean:", "shared_clean", 1 },
+    { "Shared_Dirty:", "shared_dirty", 1 },
+    { "Private_Clean:", "private_clean", 2 },
+    { "Private_Dirty:", "private_dirty", 2 },
+  };
+
+  FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+  if (fp == NULL) { return Qnil; }
+
+  VALUE stats = mrb_hash_new(mrb);
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    size_t i;
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i ++) {
+      size_t len = strlen(fields[i].field);
+      if (strncmp(line, fields[i].field, len) == 0) {
+        double kib = strtod(line + len, NULL);
+        mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_cstr(mrb, fields[i].key)), size_value(mrb, kib * 1024));
+        break;
+      }
     }
   }
+  fclose(fp);
+
+  double packed[3] = { 0, 0, 0 };
+# ifdef HAVE_PACK_ARENA
+  if ((fp = fopen("/proc/self/smaps", "r")) != NULL) {
+    bool inarena = false;
+    while (fgets(line, sizeof(line), fp)) {
+      if (isxdigit((unsigned char)line[0])) {
+        char *p;
+        uintptr_t start = (uintptr_t)strtoull(line, &p, 16);
+        uintptr_t end = (*p == '-' ? (uintptr_t)strtoull(p + 1, NULL, 16) : start);
+        inarena = pack_arena_include_p(mrb, start, end);
+        continue;
+      }
+      if (!inarena) { continue; }
+      size_t i;
+      for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i ++) {
+        size_t len = strlen(fields[i].field);
+        if (strncmp(line, fields[i].field, len) == 0) {
+          packed[fields[i].packed] += strtod(line + len, NULL) * 1024;
+          break;
+        }
+      }
+    }
+    fclose(fp);
+  }
+# endif
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("packed_shared")), size_value(mrb, packed[1]));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("packed_private")), size_value(mrb, packed[2]));
 
-  return mrb_str_new(mrb, cn.basename, cn.nameterm - cn.basename);
+  return stats;
+#else
+  return Qnil;
+#endif
 }
 
-static VALUE
-ext_extname(MRB, VALUE self)
+MRB_API mrb_value
+mruby_require_plus_require_many(MRB, int num, const char *const features[])
 {
-  VALUE arg0;
-  mrb_get_args(mrb, "S", &arg0);
-  const char *path = RSTRING_PTR(arg0);
-  size_t len = RSTRING_LEN(arg0);
-  mrbx_component_name cn = mrbx_split_path(path, len);
-
-  if (cn.extname == cn.nameterm) {
-    return Qnil;
-  } else {
-    return mrb_str_new(mrb, cn.extname, cn.nameterm - cn.extname);
+  int ai = mrb_gc_arena_save(mrb);
+  VALUE list = mrb_ary_new_capa(mrb, num);
+  int i;
+  for (i = 0; i < num; i ++) {
+    mrb_ary_push(mrb, list, mrb_str_new_cstr(mrb, features[i]));
   }
+
+  struct RClass *reqpls = mrb_module_get(mrb, "RequirePlus");
+  VALUE ret = mrb_funcall_argv(mrb, mrb_obj_value(reqpls), SYMBOL("require_many"), 1, &list);
+  mrb_gc_arena_restore(mrb, ai);
+  mrb_gc_protect(mrb, ret);
+
+  return ret;
 }
 
-static VALUE
-ext_split_path(MRB, VALUE self)
+MRB_API mrb_value
+mruby_require_plus_try_require(MRB, const char *feature)
 {
-  mrb_check_type(mrb, self, MRB_TT_STRING);
-  size_t pathlen = mrb_str_strlen(mrb, RSTRING(self));
-  const char *path = RSTRING_PTR(self);
-  mrbx_component_name cn = mrbx_split_path(path, pathlen);
+  int ai = mrb_gc_arena_save(mrb);
+  VALUE name = mrb_str_new_cstr(mrb, feature);
+  struct RClass *reqpls = mrb_module_get(mrb, "RequirePlus");
+  VALUE ret = mrb_funcall_argv(mrb, mrb_obj_value(reqpls), SYMBOL("try_require"), 1, &name);
+  mrb_gc_arena_restore(mrb, ai);
 
-  return MRBX_TUPLE(mrb_str_new(mrb, path, cn.rootterm - path),
-                    mrb_str_new(mrb, path, cn.dirterm - path),
-                    mrb_str_new(mrb, cn.basename, cn.nameterm - cn.basename),
-                    mrb_str_new(mrb, cn.extname, cn.nameterm - cn.extname));
+  return ret;
 }
 
 static VALUE
-ext_add_pathsep(MRB, VALUE self)
+ext_memory_table(MRB, VALUE self)
 {
-  mrb_check_type(mrb, self, MRB_TT_STRING);
-  mrb_str_modify(mrb, RSTRING(self));
-  aux_str_add_pathsep(mrb, self);
-  return self;
+  mrb_get_args(mrb, "");
+  return mrb_gv_get(mrb, id_memory_report);
 }
 
 static VALUE
-ext_whatmyname(MRB, VALUE self)
+rp_loader_memory(MRB, VALUE self)
 {
   mrb_get_args(mrb, "");
 
-  char path[PATH_MAX + 1];
-  int size = whatmyname(path, sizeof(path));
-  if (size > 0) {
-    return mrb_str_new(mrb, path, size);
-  } else {
-    return Qnil;
+#ifndef HAVE_MALLOC_USABLE_SIZE
+  return Qnil;
+#else
+  struct loader_memory *lm = (struct loader_memory *)mrb_data_get_ptr(mrb, mrb_gv_get(mrb, id_loader_memory), &loader_memory_type);
+  if (lm == NULL) { return Qnil; }
+
+  VALUE stats = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("last_peak")), mrb_fixnum_value((mrb_int)lm->last_peak));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("last_retain")), mrb_fixnum_value((mrb_int)lm->last_retain));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("last_rss")), mrb_fixnum_value((mrb_int)lm->last_rss));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("peak_rss")), size_value(mrb, peak_rss()));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("max_peak")), mrb_fixnum_value((mrb_int)lm->max_peak));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("total_retain")), mrb_fixnum_value((mrb_int)lm->total_retain));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(SYMBOL("compiles")), mrb_fixnum_value((mrb_int)lm->compiles));
+
+  return stats;
+#endif
+}
+
+/*
+ * ロードパスの世代番号。
+ *
+ * RequirePlus::LoadPath の変更を伴うメソッドに加えて、`$:` のオブジェクトと要素を前回の記録と比べることで、
+ * `$: += [...]` のような置き換えや C からの mrb_ary_push()、別名を通した変更も検出する。
+ * 比べるのは要素数と各要素の同一性だけであり、要素の文字列そのものを破壊的に変更した場合は検出できない。
+ * 記録は `$:` と要素を参照し続けるため、解放されたオブジェクトと同じアドレスに作られたものを取り違えることはない。
+ */
+#define id_loadpath_generation SYMBOL("loadpath generation@require+")
+#define id_loadpath_record SYMBOL("loadpath record@require+")
+
+/* [`$:`, 要素...] */
+static void
+loadpath_record(MRB, VALUE loadpath)
+{
+  mrb_int len = (mrb_array_p(loadpath) ? RARRAY_LEN(loadpath) : 0);
+  VALUE rec = mrb_ary_new_capa(mrb, len + 1);
+  mrb_ary_push(mrb, rec, loadpath);
+  if (len > 0) {
+    mrb_ary_concat(mrb, rec, loadpath);
   }
+  mrb_gv_set(mrb, id_loadpath_record, rec);
 }
 
-#define DEFAULT_LOADSIZE_MAX     ( 4 << 20) //  4 MiB (default)
-#define DEFAULT_LOADSIZE_MINIMUM (16 << 10) // 16 KiB
-#define DEFAULT_LOADSIZE_MAXIMUM (64 << 20) // 64 MiB
+static bool
+loadpath_same_p(MRB, VALUE loadpath)
+{
+  VALUE rec = mrb_gv_get(mrb, id_loadpath_record);
+  mrb_int len = (mrb_array_p(loadpath) ? RARRAY_LEN(loadpath) : 0);
+  if (!mrb_array_p(rec) || RARRAY_LEN(rec) != len + 1 || !mrb_obj_eq(mrb, RARRAY_PTR(rec)[0], loadpath)) {
+    return false;
+  }
 
-#define id_loadsize_max SYMBOL("loadsize_max@require+")
+  const mrb_value *p = RARRAY_PTR(rec) + 1;
+  const mrb_value *q = (len > 0 ? RARRAY_PTR(loadpath) : NULL);
+  mrb_int i;
+  for (i = 0; i < len; i ++) {
+    if (!mrb_obj_eq(mrb, p[i], q[i])) { return false; }
+  }
 
-MRB_API size_t
-mruby_require_plus_loadsize_max(MRB)
+  return true;
+}
+
+static void
+loadpath_changed(MRB, VALUE loadpath)
 {
-  VALUE v = mrb_gv_get(mrb, id_loadsize_max);
-  if (mrb_float_p(v)) {
-    return mrb_float(v);
+  int ai = mrb_gc_arena_save(mrb);
+  VALUE gen = mrb_gv_get(mrb, id_loadpath_generation);
+  mrb_int n = (mrb_fixnum_p(gen) ? mrb_fixnum(gen) : 0);
+  if (n < MRB_INT_MAX) {
+    n ++;
   } else {
-    return mrb_int(mrb, v);
+    /*
+     * 一巡したため、以前の世代番号と一致してしまう。
+     * 保持しているディレクトリと、Ruby 側で記録している世代番号を破棄させる。
+     */
+    n = 0;
+    sysdir_close_all(mrb);
+    struct RClass *central = mrb_module_get_under(mrb, mrb_module_get(mrb, "RequirePlus"), "Central");
+    mrb_funcall(mrb, mrb_obj_value(central), "loadpath_wrapped", 0);
   }
+  mrb_gv_set(mrb, id_loadpath_generation, mrb_fixnum_value(n));
+  loadpath_record(mrb, loadpath);
+  mrb_gc_arena_restore(mrb, ai);
 }
 
-MRB_API void
-mruby_require_plus_set_loadsize_max(MRB, size_t bytesize)
+MRB_API mrb_int
+mruby_require_plus_loadpath_generation(MRB)
 {
-  VALUE v;
-  bytesize = clamp(bytesize, DEFAULT_LOADSIZE_MINIMUM, DEFAULT_LOADSIZE_MAXIMUM);
-  if (bytesize > MRB_INT_MAX) {
-    v = mrb_float_value(mrb, bytesize);
-  } else {
-    v = mrb_fixnum_value(bytesize);
+  VALUE loadpath = mrb_gv_get(mrb, SYMBOL("$:"));
+  if (!loadpath_same_p(mrb, loadpath)) {
+    loadpath_changed(mrb, loadpath);
   }
-  mrb_gv_set(mrb, id_loadsize_max, v);
+
+  VALUE gen = mrb_gv_get(mrb, id_loadpath_generation);
+  return (mrb_fixnum_p(gen) ? mrb_fixnum(gen) : 0);
 }
 
+/*
+ * call-seq:
+ *  loadpath_changed -> nil
+ *
+ * RequirePlus::LoadPath の変更を伴うメソッドから、変更した後に呼ばれる。
+ */
 static VALUE
-rp_loadsize_max(MRB, VALUE self)
+ext_loadpath_changed(MRB, VALUE self)
 {
   mrb_get_args(mrb, "");
-  return mrb_gv_get(mrb, id_loadsize_max);
+  loadpath_changed(mrb, mrb_gv_get(mrb, SYMBOL("$:")));
+  return Qnil;
+}
+
+static VALUE
+ext_loadpath_generation(MRB, VALUE self)
+{
+  mrb_get_args(mrb, "");
+  return mrb_fixnum_value(mruby_require_plus_loadpath_generation(mrb));
 }
 
 static void
@@ -886,11 +3909,32 @@ init_central(MRB)
 
   struct RClass *reqpls = mrb_define_module(mrb, "RequirePlus");
   mrb_define_class_method(mrb, reqpls, "loadsize_max", rp_loadsize_max, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, reqpls, "memory_pages", rp_memory_pages, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, reqpls, "loader_memory", rp_loader_memory, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, reqpls, "boot_stats", rp_boot_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, reqpls, "profile", rp_profile, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, reqpls, "profile=", rp_set_profile, MRB_ARGS_REQ(1));
 
   struct RClass *central = mrb_define_module_under(mrb, reqpls, "Central");
-  mrb_define_class_method(mrb, central, "compile_from_rb", compile_from_rb, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, central, "compile_from_rb", compile_from_rb, MRB_ARGS_ARG(4, 1));
   mrb_define_class_method(mrb, central, "load_from_mrb", load_from_mrb, MRB_ARGS_REQ(3));
   mrb_define_class_method(mrb, central, "load_shared_object", load_shared_object, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, central, "predlopen_start", ext_predlopen_start, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, central, "unload_shared_object", ext_unload_shared_object, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, central, "async_read_start", ext_async_read_start, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "hooked?", ext_hooked_p, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "hook_before_resolve", ext_hook_before_resolve, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, central, "hook_after_resolve", ext_hook_after_resolve, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "hook_after_load", ext_hook_after_load, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, central, "hook_on_failure", ext_hook_on_failure, MRB_ARGS_REQ(2));
+  init_async_read(mrb, central);
+  mrb_define_const(mrb, central, "COMPILE_STRIP_DEBUG", mrb_fixnum_value(COMPILE_STRIP_DEBUG));
+  mrb_define_const(mrb, central, "COMPILE_NO_OPTIMIZE", mrb_fixnum_value(COMPILE_NO_OPTIMIZE));
+  mrb_define_class_method(mrb, central, "settle_heap", rp_settle_heap, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "compile_rb", compile_rb, MRB_ARGS_ARG(4, 1));
+  mrb_define_class_method(mrb, central, "load_mrb", load_mrb, MRB_ARGS_REQ(4));
+  mrb_define_class_method(mrb, central, "exec_on_toplevel", exec_on_toplevel, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, central, "memory_table", ext_memory_table, MRB_ARGS_NONE());
 
   mrb_define_class_method(mrb, central, "get_upper_frame", ext_get_upper_frame, MRB_ARGS_ANY());
   mrb_define_class_method(mrb, central, "makepath", ext_makepath, MRB_ARGS_ANY());
@@ -898,6 +3942,24 @@ init_central(MRB)
   mrb_define_class_method(mrb, central, "basename", ext_basename, MRB_ARGS_ANY());
   mrb_define_class_method(mrb, central, "extname", ext_extname, MRB_ARGS_ANY());
   mrb_define_class_method(mrb, central, "whatmyname", ext_whatmyname, MRB_ARGS_ANY());
+  mrb_define_class_method(mrb, central, "clock", ext_clock, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "loadpath_changed", ext_loadpath_changed, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "boot_begin", ext_boot_begin, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "boot_end", ext_boot_end, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "loadpath_generation", ext_loadpath_generation, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "extname?", ext_extname_p, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "loaded?", ext_loaded_p, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, central, "find_sysfile", ext_find_sysfile, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, central, "find_sysfiles", ext_find_sysfiles, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, central, "sysfile_size", ext_sysfile_size, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "sysdir_refresh", ext_sysdir_refresh, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "sysfile_read", ext_sysfile_read, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "sysfile_stamp", ext_sysfile_stamp, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "getcwd", ext_getcwd, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, central, "sysfile_identity", ext_sysfile_identity, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, central, "sysfile_write", ext_sysfile_write, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, central, "hexdigest", ext_hexdigest, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, central, "inflate", ext_inflate, MRB_ARGS_REQ(2));
 }
 
 static void
@@ -907,10 +3969,74 @@ init_solinks(MRB)
   mrb_gv_set(mrb, id_loaded_shared_objects(mrb), VALUE(loaded_shared_objects));
 }
 
+static void
+init_loader_memory(MRB)
+{
+  struct RData *d = mrb_data_object_alloc(mrb, NULL, NULL, &loader_memory_type);
+  mrb_gv_set(mrb, id_loader_memory, VALUE(d));
+  d->data = mrb_calloc(mrb, 1, sizeof(struct loader_memory));
+}
+
+static void
+init_boot_state(MRB)
+{
+  struct RData *d = mrb_data_object_alloc(mrb, NULL, NULL, &boot_state_type);
+  mrb_gv_set(mrb, id_boot_state, VALUE(d));
+  d->data = mrb_calloc(mrb, 1, sizeof(struct boot_state));
+}
+
+static void
+init_predlopen(MRB)
+{
+#ifdef HAVE_PTHREAD
+  struct RData *d = mrb_data_object_alloc(mrb, NULL, NULL, &predlopen_type);
+  mrb_gv_set(mrb, id_predlopen, VALUE(d));
+#endif
+}
+
+static void
+init_pack_arena(MRB)
+{
+#ifdef HAVE_PACK_ARENA
+  struct RData *d = mrb_data_object_alloc(mrb, NULL, NULL, &pack_arena_type);
+  mrb_gv_set(mrb, id_pack_arena, VALUE(d));
+#endif
+}
+
+static void
+init_memory_report(MRB)
+{
+  mrb_gv_set(mrb, id_memory_report, mrb_hash_new(mrb));
+}
+
+static void
+init_hooks(MRB)
+{
+  struct RData *d = mrb_data_object_alloc(mrb, NULL, NULL, &hooks_type);
+  mrb_gv_set(mrb, id_hooks, VALUE(d));
+}
+
+static void
+init_sysdirs(MRB)
+{
+  struct sysdir_table *t = (struct sysdir_table *)mrb_calloc(mrb, 1, sizeof(struct sysdir_table));
+  struct RData *d = mrb_data_object_alloc(mrb, NULL, t, &sysdir_table_type);
+  mrb_gv_set(mrb, id_sysdir_table, VALUE(d));
+}
+
 static void
 init_loadpath(MRB)
 {
-  VALUE loadpath = mrb_ary_new(mrb);
+  /*
+   * `$:` は Array を継承した RequirePlus::LoadPath のインスタンスとする。
+   * 変更を伴うメソッドは mrblib で再定義され、世代番号を増加させる。
+   */
+  struct RClass *reqpls = mrb_define_module(mrb, "RequirePlus");
+  struct RClass *lpclass = mrb_define_class_under(mrb, reqpls, "LoadPath", mrb->array_class);
+  MRB_SET_INSTANCE_TT(lpclass, MRB_TT_ARRAY);
+  mrb_gv_set(mrb, id_loadpath_generation, mrb_fixnum_value(0));
+
+  VALUE loadpath = mrb_obj_new(mrb, lpclass, 0, NULL);
   int ai = mrb_gc_arena_save(mrb);
   mrb_gv_set(mrb, SYMBOL("$:"), loadpath);
   mrb_gv_set(mrb, SYMBOL("$LOAD_PATH"), loadpath);
@@ -985,6 +4111,20 @@ mrb_mruby_require_plus_gem_init(MRB)
 
   init_solinks(mrb);
   mrb_gc_arena_restore(mrb, ai);
+  init_sysdirs(mrb);
+  mrb_gc_arena_restore(mrb, ai);
+  init_loader_memory(mrb);
+  mrb_gc_arena_restore(mrb, ai);
+  init_boot_state(mrb);
+  mrb_gc_arena_restore(mrb, ai);
+  init_predlopen(mrb);
+  mrb_gc_arena_restore(mrb, ai);
+  init_pack_arena(mrb);
+  mrb_gc_arena_restore(mrb, ai);
+  init_memory_report(mrb);
+  mrb_gc_arena_restore(mrb, ai);
+  init_hooks(mrb);
+  mrb_gc_arena_restore(mrb, ai);
   init_loadpath(mrb);
   mrb_gc_arena_restore(mrb, ai);
   init_loadedfeatures(mrb);
@@ -1001,6 +4141,8 @@ mrb_mruby_require_plus_gem_init(MRB)
 void
 mrb_mruby_require_plus_gem_final(MRB)
 {
+  sysdir_close_all(mrb);
+
   mrb_value loaded_shareds = mrb_gv_get(mrb, id_loaded_shared_objects(mrb));
   struct loaded_shared_objects *so = (struct loaded_shared_objects *)mrb_data_check_get_ptr(mrb, loaded_shareds, &loaded_shared_object_type);
   if (so == NULL) { return; }
@@ -0,0 +1,53 @@
+#!ruby
+
+assert("autoload") do
+  RequirePlusTest.loadpath("rp_auto_a.rb" => "$rp_auto_a = ($rp_auto_a || 0) + 1\nclass RpAutoA; end\n") do
+    assert_nil autoload(:RpAutoA, "rp_auto_a")
+    assert_equal "rp_auto_a", autoload?(:RpAutoA)
+    assert_nil $rp_auto_a
+    assert_equal "RpAutoA", RpAutoA.name
+    assert_equal 1, $rp_auto_a
+    assert_nil autoload?(:RpAutoA)
+    RpAutoA
+    assert_equal 1, $rp_auto_a
+  end
+end
+
+assert("Module#autoload - nested constant") do
+  RequirePlusTest.loadpath("rp_auto_ns/b.rb" => "module RpAutoNS; class B; end; end\n") do
+    module RpAutoNS; end
+    RpAutoNS.autoload(:B, "rp_auto_ns/b")
+    assert_equal "rp_auto_ns/b", RpAutoNS.autoload?(:B)
+    assert_equal "RpAutoNS::B", RpAutoNS::B.name
+  end
+end
+
+assert("RequirePlus.autoload - namespace not yet defined") do
+  RequirePlusTest.loadpath("rp_auto_c.rb" => "module RpAutoC; C = :c; end\n") do
+    RequirePlus.autoload("RpAutoC::C", "rp_auto_c")
+    module RpAutoC; end
+    assert_equal "rp_auto_c", RpAutoC.autoload?(:C)
+    assert_equal :c, RpAutoC::C
+  end
+end
+
+assert("autoload - top-level constant referenced inside a module body") do
+  RequirePlusTest.loadpath("rp_auto_top.rb" => "RpAutoTop = :top\n") do
+    autoload(:RpAutoTop, "rp_auto_top")
+    module RpAutoOuter
+      def self.top
+        RpAutoTop
+      end
+    end
+    assert_equal :top, RpAutoOuter.top
+    assert_nil autoload?(:RpAutoTop)
+  end
+end
+
+assert("autoload - registration is kept when require fails") do
+  RequirePlusTest.loadpath("rp_auto_err.rb" => "raise 'rp_auto_err'\n") do
+    autoload(:RpAutoErr, "rp_auto_err")
+    assert_raise(RuntimeError) { RpAutoErr }
+    assert_equal "rp_auto_err", autoload?(:RpAutoErr)
+  end
+end
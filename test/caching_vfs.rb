@@ -0,0 +1,110 @@
+#!ruby
+
+class RequirePlusTest::SlowVFS
+  attr_reader :reads, :probes
+  attr_accessor :stamp
+
+  def initialize(files)
+    @files = files
+    @reads = []
+    @probes = []
+    @stamp = 1
+  end
+
+  def to_path
+    "slowvfs:#{object_id}"
+  end
+
+  def file?(path)
+    @probes << path
+    @files.has_key?(path)
+  end
+
+  def size(path)
+    (d = @files[path]) && d.bytesize
+  end
+
+  def read(path)
+    @reads << path
+    @files[path]
+  end
+
+  def []=(path, data)
+    @files[path] = data
+  end
+
+  def mtime(path)
+    @stamp
+  end
+
+  def read_many(paths)
+    @reads.concat paths
+    paths.map { |path| @files[path] }
+  end
+end
+
+assert("RequirePlus::Central.hexdigest is SHA-256") do
+  assert_equal "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", RequirePlus::Central.hexdigest("abc")
+end
+
+assert("RequirePlus::CachingVFS") do
+  RequirePlusTest.tmpdir do |dir|
+    cachedir = "#{dir}/cache"
+    inner = RequirePlusTest::SlowVFS.new("a.rb" => "a", "b.rb" => "b")
+
+    vfs = RequirePlus::CachingVFS.new(inner, dir: cachedir)
+    assert_equal "a", vfs.read("a.rb")
+    assert_equal 0700, RequirePlusTest.mode(cachedir)
+    assert_equal 0600, RequirePlusTest.mode("#{cachedir}/#{RequirePlus::Central.hexdigest("a")}.data")
+
+    # 別のインスタンスからも保存した内容が使われる
+    vfs = RequirePlus::CachingVFS.new(inner, dir: cachedir)
+    assert_equal ["a", "b"], vfs.read_many(["a.rb", "b.rb"])
+    assert_equal ["a.rb", "b.rb"], inner.reads
+
+    # 元のファイルの刻印 (mtime) が変われば読み込み直す
+    inner["a.rb"] = "A"
+    inner.stamp = 2
+    vfs = RequirePlus::CachingVFS.new(inner, dir: cachedir)
+    assert_equal "A", vfs.read("a.rb")
+    assert_equal ["a.rb", "b.rb", "a.rb"], inner.reads
+  end
+end
+
+assert("RequirePlus::CachingVFS - delegates optional methods") do
+  RequirePlusTest.tmpdir do |dir|
+    vfs = RequirePlus::CachingVFS.new(RequirePlusTest::SlowVFS.new({}), dir: dir)
+    assert_true vfs.respond_to?(:read_many)
+    assert_true vfs.respond_to?(:mtime)
+    assert_false vfs.respond_to?(:lookup)
+    assert_false vfs.respond_to?(:compile_profile)
+    assert_false vfs.respond_to?(:identity)
+    assert_equal 1, vfs.mtime("a.rb")
+  end
+end
+
+assert("RequirePlus::CachingVFS - resolution is served from the cache") do
+  RequirePlusTest.tmpdir do |dir|
+    cachedir = "#{dir}/cache"
+    inner = RequirePlusTest::SlowVFS.new("rp_cv.rb" => "")
+
+    vfs = RequirePlus::CachingVFS.new(inner, dir: cachedir)
+    assert_equal [:rb, "rp_cv.rb"], RequirePlus::Central.resolve(vfs, "rp_cv")
+    assert_nil RequirePlus::Central.resolve(vfs, "rp_cv_none")
+    assert_false inner.probes.empty?
+
+    # 二度目の起動では、見つからなかったものも含めて問い合わせない
+    inner.probes.clear
+    vfs = RequirePlus::CachingVFS.new(inner, dir: cachedir)
+    assert_equal [:rb, "rp_cv.rb"], RequirePlus::Central.resolve(vfs, "rp_cv")
+    assert_nil RequirePlus::Central.resolve(vfs, "rp_cv_none")
+    assert_equal [], inner.probes
+
+    # 刻印が変われば問い合わせ直す
+    inner["rp_cv_none.rb"] = ""
+    inner.stamp = 2
+    vfs = RequirePlus::CachingVFS.new(inner, dir: cachedir)
+    assert_equal [:rb, "rp_cv_none.rb"], RequirePlus::Central.resolve(vfs, "rp_cv_none")
+    assert_false inner.probes.empty?
+  end
+end
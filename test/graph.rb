@@ -0,0 +1,41 @@
+#!ruby
+
+assert("RequirePlus.graph - recorded only while profiling") do
+  files = {
+    "rp_graph_off.rb" => "",
+    "rp_graph_a.rb" => "require 'rp_graph_b'\n",
+    "rp_graph_b.rb" => "",
+  }
+  RequirePlusTest.loadpath(files) do |dir|
+    a = "#{dir}/rp_graph_a.rb"
+    b = "#{dir}/rp_graph_b.rb"
+
+    RequirePlus.profile = false
+    assert_true require("rp_graph_off")
+    assert_nil RequirePlus.graph["#{dir}/rp_graph_off.rb"]
+
+    RequirePlus.profile = true
+    begin
+      assert_true require("rp_graph_a")
+    ensure
+      RequirePlus.profile = false
+    end
+    g = RequirePlus.graph
+    assert_equal [b], g[a].children
+    assert_equal [a], g[b].parents
+    assert_true g.edges.include?([a, b])
+
+    assert_true RequirePlus.unload("rp_graph_b")
+    g = RequirePlus.graph
+    assert_nil g[b]
+    assert_equal [], g[a].children
+    assert_true RequirePlus.unload("rp_graph_a")
+    assert_nil RequirePlus.graph[a]
+  end
+end
+
+assert("RequirePlus::Graph#to_dot - escapes backslashes") do
+  node = RequirePlus::Graph::Node.new("C:\\rp\\\"x\".rb", [], [], 0.0, 0.0, 0)
+  dot = RequirePlus::Graph.new(node.signature => node).to_dot
+  assert_true dot.include?("\"C:\\\\rp\\\\\\\"x\\\".rb\" [label=\"C:\\\\rp\\\\\\\"x\\\".rb\\n")
+end
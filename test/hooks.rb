@@ -0,0 +1,80 @@
+#!ruby
+
+assert("hooks - require") do
+  RequirePlusTest.loadpath("rp_hook_a.rb" => "") do |dir|
+    sig = "#{dir}/rp_hook_a.rb"
+    events = RequirePlusTest.record_hooks { require "rp_hook_a" }
+    assert_equal [[:before_resolve, "rp_hook_a"], [:after_resolve, "rp_hook_a", sig], [:after_load, sig]], events
+  end
+end
+
+assert("hooks - on_failure is called once for a nested failure") do
+  RequirePlusTest.loadpath("rp_hook_outer.rb" => "require 'rp_hook_none'\n") do
+    events = RequirePlusTest.record_hooks do
+      assert_raise(LoadError) { require "rp_hook_outer" }
+    end
+    failures = events.select { |ev| ev[0] == :on_failure }
+    assert_equal 1, failures.size
+    assert_equal "rp_hook_none", failures[0][1]
+    assert_true failures[0][2].kind_of?(LoadError)
+    assert_true events.include?([:after_resolve, "rp_hook_none", false])
+  end
+end
+
+assert("hooks - require_relative") do
+  files = {
+    "rp_hook_rel/a.rb" => "require_relative 'b'\n",
+    "rp_hook_rel/b.rb" => "",
+  }
+  RequirePlusTest.loadpath(files) do |dir|
+    events = RequirePlusTest.record_hooks { require "rp_hook_rel/a" }
+    assert_true events.include?([:before_resolve, "b"])
+    assert_true events.include?([:after_resolve, "b", "#{dir}/rp_hook_rel/b.rb"])
+    assert_true events.include?([:after_load, "#{dir}/rp_hook_rel/b.rb"])
+  end
+end
+
+assert("hooks - RequirePlus.try_require") do
+  RequirePlusTest.loadpath("rp_hook_try.rb" => "") do |dir|
+    events = RequirePlusTest.record_hooks do
+      assert_nil RequirePlus.try_require("rp_hook_try_none")
+      assert_true RequirePlus.try_require("rp_hook_try")
+    end
+    sig = "#{dir}/rp_hook_try.rb"
+    assert_equal [[:before_resolve, "rp_hook_try_none"], [:after_resolve, "rp_hook_try_none", false],
+                  [:before_resolve, "rp_hook_try"], [:after_resolve, "rp_hook_try", sig], [:after_load, sig]], events
+  end
+end
+
+assert("hooks - RequirePlus.require_many") do
+  RequirePlusTest.loadpath("rp_hook_m1.rb" => "", "rp_hook_m2.rb" => "") do |dir|
+    events = RequirePlusTest.record_hooks do
+      assert_equal [true, true], RequirePlus.require_many(["rp_hook_m1", "rp_hook_m2"])
+    end
+    assert_equal ["rp_hook_m1", "rp_hook_m2"], events.select { |ev| ev[0] == :before_resolve }.map { |ev| ev[1] }
+    assert_equal ["#{dir}/rp_hook_m1.rb", "#{dir}/rp_hook_m2.rb"], events.select { |ev| ev[0] == :after_load }.map { |ev| ev[1] }
+  end
+end
+
+assert("hooks - RequirePlus.require_async") do
+  RequirePlusTest.loadpath("rp_hook_async.rb" => "raise 'rp_hook_async'\n") do |dir|
+    sig = "#{dir}/rp_hook_async.rb"
+    events = RequirePlusTest.record_hooks do
+      req = RequirePlus.require_async("rp_hook_async")
+      assert_raise(RuntimeError) { req.value }
+      assert_raise(RuntimeError) { req.value }
+    end
+    assert_equal [:before_resolve, "rp_hook_async"], events[0]
+    assert_equal [:after_resolve, "rp_hook_async", sig], events[1]
+    assert_equal 1, events.select { |ev| ev[0] == :on_failure }.size
+  end
+end
+
+assert("hooks - the reported exception is not kept") do
+  RequirePlusTest.loadpath do
+    RequirePlusTest.record_hooks do
+      assert_raise(LoadError) { require "rp_hook_gone" }
+    end
+    assert_nil RequirePlus::Central.instance_variable_get(:@reported_failure)
+  end
+end
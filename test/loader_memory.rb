@@ -0,0 +1,80 @@
+#!ruby
+
+assert("parser nodes are allocated from mrb_pool") do
+  # 一行あたり十個ほどのノードが作られるが、mrb_pool のページ単位でしか確保されない
+  lines = 2000
+  count = RequirePlusTest.count_parse_allocations("a = [1, 2, 3]\n" * lines)
+  assert_true count < lines / 10, "#{count} allocations for #{lines} lines"
+end
+
+assert("RequirePlus.loader_memory") do
+  skip "needs malloc_usable_size()" unless RequirePlus.loader_memory
+
+  code = (0...500).map { |i| "def rp_lm_#{i}(a) [a, #{i}, \"s#{i}\"] end\n" }.join
+  RequirePlusTest.loadpath("rp_loader_memory.rb" => code) do
+    compiles = RequirePlus.loader_memory[:compiles]
+    assert_true require("rp_loader_memory")
+    lm = RequirePlus.loader_memory
+    assert_equal compiles + 1, lm[:compiles]
+    assert_true lm[:last_retain] > 0
+    # 構文木とコード生成の作業領域は解放され、irep などだけが残る
+    assert_true lm[:last_peak] > lm[:last_retain], "peak=#{lm[:last_peak]} retain=#{lm[:last_retain]}"
+    assert_true lm[:last_rss] >= 0
+    assert_true lm[:peak_rss] > 0
+  end
+end
+
+assert("RequirePlus.set_compile_profile - debug: false saves memory") do
+  code = (0...200).map { |i| "def rp_prof_m#{i}(a)\n  [a,\n   #{i}]\nend\n" }.join
+  report = {}
+  [:plain, :stripped].each do |name|
+    RequirePlusTest.loadpath("rp_prof_#{name}.rb" => code) do |dir|
+      RequirePlus.set_compile_profile(dir, debug: false) if name == :stripped
+      begin
+        assert_true require("rp_prof_#{name}")
+        sig = "#{dir}/rp_prof_#{name}.rb"
+        report[name] = RequirePlus.memory_report.find { |(s, _)| s == sig }[1]
+      ensure
+        RequirePlus.set_compile_profile(dir, nil)
+      end
+    end
+  end
+
+  assert_true report[:plain][:debug] > 0
+  assert_equal 0, report[:stripped][:debug]
+  assert_equal report[:plain][:iseq], report[:stripped][:iseq]
+  assert_equal report[:plain][:irep] - report[:plain][:debug], report[:stripped][:irep]
+end
+
+assert("RequirePlus.memory_report - heap is recorded only while profiling") do
+  RequirePlusTest.loadpath("rp_heap_off.rb" => "$rp_heap_off = [1, 2, 3]\n") do |dir|
+    assert_false RequirePlus.profile
+    assert_true require("rp_heap_off")
+    sig = "#{dir}/rp_heap_off.rb"
+    assert_false RequirePlus.memory_report.find { |(s, _)| s == sig }[1].key?(:heap)
+  end
+end
+
+assert("RequirePlus.memory_report - heap of nested features is subtracted at every level") do
+  files = {
+    "rp_heap_a.rb" => "require 'rp_heap_b'\n$rp_heap_a = 'a' * 20000\n",
+    "rp_heap_b.rb" => "require 'rp_heap_c'\n$rp_heap_b = 'b' * 40000\n",
+    "rp_heap_c.rb" => "$rp_heap_c = 'c' * 200000\n",
+  }
+  RequirePlusTest.loadpath(files) do |dir|
+    RequirePlus.profile = true
+    begin
+      assert_true require("rp_heap_a")
+    ensure
+      RequirePlus.profile = false
+    end
+
+    report = RequirePlus.memory_report
+    heap = %w(a b c).map { |n| report.find { |(s, _)| s == "#{dir}/rp_heap_#{n}.rb" }[1][:heap] }
+    skip "heap is not measured" if heap.include?(nil)
+
+    assert_true heap[2] >= 200000, "c=#{heap[2]}"
+    assert_true heap[1] >= 40000 && heap[1] < 200000, "b=#{heap[1]}"
+    assert_true heap[0] >= 20000 && heap[0] < 200000, "a=#{heap[0]}"
+  end
+end
@@ -0,0 +1,501 @@
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+# define _XOPEN_SOURCE 700 /* for mkdtemp() and nftw() */
+#endif
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/compile.h>
+#include <mruby/error.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+#include <mruby-require-plus.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <ftw.h>
+#ifndef _WIN32
+# include <unistd.h>
+# include <sys/wait.h>
+#endif
+
+/*
+ * テストのための補助関数 (RequirePlusTest)。
+ *
+ * 読み込まれるファイルは test/ の下に置くとテストそのものとして扱われるため、一時ディレクトリに書き出す。
+ */
+
+static int
+rmtree_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  remove(path);
+  return 0;
+}
+
+static void
+rmtree(const char *path)
+{
+  nftw(path, rmtree_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * `path` に `data` を書き込む。途中のディレクトリがなければ作成する。
+ */
+static void
+write_file(mrb_state *mrb, mrb_value path, mrb_value data)
+{
+  char buf[PATH_MAX];
+  const char *p = mrb_string_value_cstr(mrb, &path);
+  size_t len = strlen(p);
+  size_t i;
+
+  if (len >= sizeof(buf)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "too long path - %S", path);
+  }
+  memcpy(buf, p, len + 1);
+  for (i = 1; i < len; i ++) {
+    if (buf[i] != '/') { continue; }
+    buf[i] = '\0';
+    mkdir(buf, 0700);
+    buf[i] = '/';
+  }
+
+  FILE *fp = fopen(buf, "wb");
+  if (fp == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "failed open - %S", path);
+  }
+  size_t n = fwrite(RSTRING_PTR(data), 1, RSTRING_LEN(data), fp);
+  if (fclose(fp) != 0 || n != (size_t)RSTRING_LEN(data)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "failed write - %S", path);
+  }
+}
+
+static mrb_value
+make_tmpdir(mrb_state *mrb, mrb_value files)
+{
+  const char *root = getenv("TMPDIR");
+  char buf[PATH_MAX];
+  if (root == NULL || root[0] == '\0') { root = "/tmp"; }
+  if (snprintf(buf, sizeof(buf), "%s/mruby-require-plus-test.XXXXXX", root) >= (int)sizeof(buf) ||
+      mkdtemp(buf) == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed mkdtemp");
+  }
+
+  mrb_value dir = mrb_str_new_cstr(mrb, buf);
+  if (mrb_hash_p(files)) {
+    mrb_value keys = mrb_hash_keys(mrb, files);
+    mrb_int i;
+    for (i = 0; i < RARRAY_LEN(keys); i ++) {
+      mrb_value key = RARRAY_PTR(keys)[i];
+      mrb_value data = mrb_hash_get(mrb, files, key);
+      mrb_value path = mrb_str_dup(mrb, dir);
+      mrb_str_cat_lit(mrb, path, "/");
+      mrb_str_concat(mrb, path, key);
+      mrb_check_type(mrb, data, MRB_TT_STRING);
+      write_file(mrb, path, data);
+    }
+  }
+
+  return dir;
+}
+
+/* [dir, block, loadpath?] */
+static mrb_value
+tmpdir_body(mrb_state *mrb, mrb_value args)
+{
+  mrb_value dir = RARRAY_PTR(args)[0];
+  if (mrb_test(RARRAY_PTR(args)[2])) {
+    mrb_funcall(mrb, mrb_gv_get(mrb, mrb_intern_lit(mrb, "$:")), "unshift", 1, dir);
+  }
+  return mrb_yield(mrb, RARRAY_PTR(args)[1], dir);
+}
+
+static mrb_value
+tmpdir_cleanup(mrb_state *mrb, mrb_value args)
+{
+  mrb_value dir = RARRAY_PTR(args)[0];
+  if (mrb_test(RARRAY_PTR(args)[2])) {
+    mrb_funcall(mrb, mrb_gv_get(mrb, mrb_intern_lit(mrb, "$:")), "delete", 1, dir);
+  }
+  rmtree(RSTRING_PTR(dir));
+  return mrb_nil_value();
+}
+
+static mrb_value
+with_tmpdir(mrb_state *mrb, mrb_bool loadpath)
+{
+  mrb_value files = mrb_nil_value(), block;
+  mrb_get_args(mrb, "|H&", &files, &block);
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "need block");
+  }
+
+  mrb_value argv[3];
+  argv[0] = make_tmpdir(mrb, files);
+  argv[1] = block;
+  argv[2] = mrb_bool_value(loadpath);
+  mrb_value args = mrb_ary_new_from_values(mrb, 3, argv);
+
+  return mrb_ensure(mrb, tmpdir_body, args, tmpdir_cleanup, args);
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.tmpdir(files = {}) { |dir| ... }
+ *
+ * `files` (相対パスと内容の組) を書き出した一時ディレクトリを作り、ブロックを抜けると削除する。
+ */
+static mrb_value
+test_tmpdir(mrb_state *mrb, mrb_value self)
+{
+  return with_tmpdir(mrb, FALSE);
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.loadpath(files = {}) { |dir| ... }
+ *
+ * RequirePlusTest.tmpdir と同じだが、ブロックの間は一時ディレクトリを `$:` の先頭に加える。
+ */
+static mrb_value
+test_loadpath(mrb_state *mrb, mrb_value self)
+{
+  return with_tmpdir(mrb, TRUE);
+}
+
+static mrb_value
+test_write(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path, data;
+  mrb_get_args(mrb, "SS", &path, &data);
+  write_file(mrb, path, data);
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.replace(path, data, mtime) -> nil
+ *
+ * 別のファイルに `data` を書き込んで更新時刻を `mtime` にしてから、`path` へ名前を変える (別の i-node となる)。
+ */
+static mrb_value
+test_replace(mrb_state *mrb, mrb_value self)
+{
+  mrb_value path, data;
+  mrb_int mtime;
+  mrb_get_args(mrb, "SSi", &path, &data, &mtime);
+
+  mrb_value tmp = mrb_str_dup(mrb, path);
+  mrb_str_cat_lit(mrb, tmp, ".tmp");
+  write_file(mrb, tmp, data);
+
+  struct utimbuf times;
+  times.actime = times.modtime = (time_t)mtime;
+  if (utime(RSTRING_PTR(tmp), &times) != 0 ||
+      rename(RSTRING_PTR(tmp), RSTRING_PTR(path)) != 0) {
+    remove(RSTRING_PTR(tmp));
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "failed replace - %S", path);
+  }
+
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.ary_push(ary, obj) -> ary
+ *
+ * メソッドを呼ばずに、mrb_ary_push() で直接 `ary` に `obj` を加える。
+ */
+static mrb_value
+test_ary_push(mrb_state *mrb, mrb_value self)
+{
+  mrb_value ary, obj;
+  mrb_get_args(mrb, "Ao", &ary, &obj);
+  mrb_ary_push(mrb, ary, obj);
+  return ary;
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.mode(path) -> integer or nil
+ *
+ * `path` の許可属性 (st_mode の下位 9 ビット) を返す。
+ */
+static mrb_value
+test_mode(mrb_state *mrb, mrb_value self)
+{
+  const char *path;
+  mrb_get_args(mrb, "z", &path);
+
+  struct stat st;
+  if (stat(path, &st) != 0) { return mrb_nil_value(); }
+  return mrb_fixnum_value(st.st_mode & 0777);
+}
+
+struct alloc_counter
+{
+  mrb_allocf allocf;
+  void *allocf_ud;
+  mrb_int count;
+};
+
+static void *
+counting_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  struct alloc_counter *c = (struct alloc_counter *)ud;
+  if (size > 0) { c->count ++; }
+  return c->allocf(mrb, p, size, c->allocf_ud);
+}
+
+static mrb_value
+count_body(mrb_state *mrb, mrb_value block)
+{
+  return mrb_yield_argv(mrb, block, 0, NULL);
+}
+
+static mrb_value
+count_cleanup(mrb_state *mrb, mrb_value opaque)
+{
+  struct alloc_counter *c = (struct alloc_counter *)mrb_cptr(opaque);
+  mrb->allocf = c->allocf;
+  mrb->allocf_ud = c->allocf_ud;
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.count_allocations { ... } -> integer
+ *
+ * ブロックの実行中に mrb->allocf によって確保 (あるいは再確保) された回数を返す。
+ * 途中で GC が動かないように、完全な GC を行ってから数え始める。
+ */
+static mrb_value
+test_count_allocations(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block;
+  mrb_get_args(mrb, "&", &block);
+
+  struct alloc_counter c;
+  c.allocf = mrb->allocf;
+  c.allocf_ud = mrb->allocf_ud;
+  c.count = 0;
+
+  mrb_full_gc(mrb);
+  mrb->allocf = counting_allocf;
+  mrb->allocf_ud = &c;
+  mrb_ensure(mrb, count_body, block, count_cleanup, mrb_cptr_value(mrb, &c));
+
+  return mrb_fixnum_value(c.count);
+}
+
+/*
+ * RequirePlusTest.record_hooks で登録するフック。呼ばれた順に `$rp_hook_events` へ記録する。
+ */
+static void
+record_event(mrb_state *mrb, const char *name, const char *arg, mrb_value extra)
+{
+  mrb_value events = mrb_gv_get(mrb, mrb_intern_lit(mrb, "$rp_hook_events"));
+  if (!mrb_array_p(events)) { return; }
+
+  mrb_value ev[3];
+  ev[0] = mrb_symbol_value(mrb_intern_cstr(mrb, name));
+  ev[1] = arg ? mrb_str_new_cstr(mrb, arg) : mrb_nil_value();
+  ev[2] = extra;
+  mrb_ary_push(mrb, events, mrb_ary_new_from_values(mrb, mrb_nil_p(extra) ? 2 : 3, ev));
+}
+
+static void
+record_before_resolve(mrb_state *mrb, void *ud, const char *feature)
+{
+  record_event(mrb, "before_resolve", feature, mrb_nil_value());
+}
+
+static void
+record_after_resolve(mrb_state *mrb, void *ud, const char *feature, const char *signature)
+{
+  record_event(mrb, "after_resolve", feature, signature ? mrb_str_new_cstr(mrb, signature) : mrb_false_value());
+}
+
+static void
+record_after_load(mrb_state *mrb, void *ud, const char *signature)
+{
+  record_event(mrb, "after_load", signature, mrb_nil_value());
+}
+
+static void
+record_on_failure(mrb_state *mrb, void *ud, const char *feature, mrb_value exc)
+{
+  record_event(mrb, "on_failure", feature, exc);
+}
+
+static mrb_value
+record_hooks_cleanup(mrb_state *mrb, mrb_value unused)
+{
+  mruby_require_plus_set_hooks(mrb, NULL);
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.record_hooks { ... } -> events
+ *
+ * ブロックの間だけフックを登録し、呼ばれたフックを `[name, feature or signature, (signature or exception)]` の配列として返す。
+ * `after_resolve` で見つからなかった場合、3 番目の要素は false となる。
+ */
+static mrb_value
+test_record_hooks(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block;
+  mrb_get_args(mrb, "&", &block);
+
+  mrb_value events = mrb_ary_new(mrb);
+  mrb_gv_set(mrb, mrb_intern_lit(mrb, "$rp_hook_events"), events);
+
+  struct mruby_require_plus_hooks hooks = { 0 };
+  hooks.before_resolve = record_before_resolve;
+  hooks.after_resolve = record_after_resolve;
+  hooks.after_load = record_after_load;
+  hooks.on_failure = record_on_failure;
+  mruby_require_plus_set_hooks(mrb, &hooks);
+  mrb_ensure(mrb, count_body, block, record_hooks_cleanup, mrb_nil_value());
+  mrb_gv_set(mrb, mrb_intern_lit(mrb, "$rp_hook_events"), mrb_nil_value());
+
+  return events;
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.count_parse_allocations(code) -> integer
+ *
+ * `code` の構文解析 (mrb_parse_nstring() から mrb_parser_free() まで) の間に mrb->allocf が呼ばれた回数を返す。
+ */
+static mrb_value
+test_count_parse_allocations(mrb_state *mrb, mrb_value self)
+{
+  const char *code;
+  mrb_int codesize;
+  mrb_get_args(mrb, "s", &code, &codesize);
+
+  struct alloc_counter c;
+  c.allocf = mrb->allocf;
+  c.allocf_ud = mrb->allocf_ud;
+  c.count = 0;
+
+  mrb_full_gc(mrb);
+  mrb->allocf = counting_allocf;
+  mrb->allocf_ud = &c;
+  struct mrb_parser_state *parser = mrb_parse_nstring(mrb, code, codesize, NULL);
+  mrb_bool failed = (parser == NULL || parser->nerr > 0);
+  if (parser) { mrb_parser_free(parser); }
+  mrb->allocf = c.allocf;
+  mrb->allocf_ud = c.allocf_ud;
+
+  if (failed) {
+    mrb_raise(mrb, E_SYNTAX_ERROR, "failed parse");
+  }
+
+  return mrb_fixnum_value(c.count);
+}
+
+#ifndef _WIN32
+/*
+ * call-seq:
+ *  RequirePlusTest.symlink(target, path) -> nil
+ *
+ * `path` を `target` へのシンボリックリンクにする。既に存在すれば置き換える。
+ */
+static mrb_value
+test_symlink(mrb_state *mrb, mrb_value self)
+{
+  const char *target, *path;
+  mrb_get_args(mrb, "zz", &target, &path);
+
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp) ||
+      symlink(target, tmp) != 0 ||
+      rename(tmp, path) != 0) {
+    remove(tmp);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "failed symlink - %S", mrb_str_new_cstr(mrb, path));
+  }
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+child_memory_pages(mrb_state *mrb, mrb_value fdv)
+{
+  mrb_full_gc(mrb);
+
+  mrb_value reqpls = mrb_obj_value(mrb_module_get(mrb, "RequirePlus"));
+  mrb_value stats = mrb_funcall(mrb, reqpls, "memory_pages", 0);
+  double pages[2];
+  pages[0] = mrb_float(mrb_funcall(mrb, mrb_hash_get(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "packed_shared"))), "to_f", 0));
+  pages[1] = mrb_float(mrb_funcall(mrb, mrb_hash_get(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "packed_private"))), "to_f", 0));
+  if (write((int)mrb_fixnum(fdv), pages, sizeof(pages)) != sizeof(pages)) {
+    _exit(1);
+  }
+
+  return mrb_nil_value();
+}
+
+/*
+ * call-seq:
+ *  RequirePlusTest.packed_pages_in_child -> [packed_shared, packed_private]
+ *
+ * fork() した子プロセスで GC を完全に行った後の RequirePlus.memory_pages を、親プロセスへ返す。
+ * 子プロセスはテストの続きを実行せずに終了する。
+ */
+static mrb_value
+test_packed_pages_in_child(mrb_state *mrb, mrb_value self)
+{
+  int fds[2];
+  if (pipe(fds) != 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed pipe");
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    mrb_bool failed = FALSE;
+    mrb_protect(mrb, child_memory_pages, mrb_fixnum_value(fds[1]), &failed);
+    _exit(failed ? 1 : 0);
+  }
+
+  close(fds[1]);
+  double pages[2];
+  ssize_t n = (pid == -1 ? -1 : read(fds[0], pages, sizeof(pages)));
+  close(fds[0]);
+  int status = 0;
+  if (pid != -1) { waitpid(pid, &status, 0); }
+  if (n != sizeof(pages) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "failed child process");
+  }
+
+  mrb_value argv[2];
+  argv[0] = mrb_float_value(mrb, pages[0]);
+  argv[1] = mrb_float_value(mrb, pages[1]);
+  return mrb_ary_new_from_values(mrb, 2, argv);
+}
+#endif
+
+void
+mrb_mruby_require_plus_gem_test(mrb_state *mrb)
+{
+  struct RClass *test = mrb_define_module(mrb, "RequirePlusTest");
+  mrb_define_class_method(mrb, test, "tmpdir", test_tmpdir, MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  mrb_define_class_method(mrb, test, "loadpath", test_loadpath, MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  mrb_define_class_method(mrb, test, "write", test_write, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, test, "replace", test_replace, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, test, "ary_push", test_ary_push, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, test, "mode", test_mode, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, test, "record_hooks", test_record_hooks, MRB_ARGS_BLOCK());
+  mrb_define_class_method(mrb, test, "count_allocations", test_count_allocations, MRB_ARGS_BLOCK());
+  mrb_define_class_method(mrb, test, "count_parse_allocations", test_count_parse_allocations, MRB_ARGS_REQ(1));
+#ifndef _WIN32
+  mrb_define_class_method(mrb, test, "symlink", test_symlink, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, test, "packed_pages_in_child", test_packed_pages_in_child, MRB_ARGS_NONE());
+#endif
+}
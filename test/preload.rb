@@ -0,0 +1,18 @@
+#!ruby
+
+assert("preload_for_fork - packed pages stay shared after fork") do
+  unless RequirePlus.memory_pages && RequirePlusTest.respond_to?(:packed_pages_in_child)
+    skip "needs /proc/self/smaps and fork()"
+  end
+
+  literal = "a string literal that is too long to be embedded"
+  files = { "rp_packed.rb" => "def rp_packed_literal\n  #{literal.inspect}\nend\n" }
+  RequirePlusTest.loadpath(files) do
+    assert_nil RequirePlus.preload_for_fork(%w(rp_packed))
+    assert_equal literal, rp_packed_literal
+
+    shared, private = RequirePlusTest.packed_pages_in_child
+    assert_true shared > 0
+    assert_equal 0, private
+  end
+end
@@ -0,0 +1,174 @@
+#!ruby
+
+assert("require") do
+  RequirePlusTest.loadpath("rp_basic.rb" => "$rp_basic = ($rp_basic || 0) + 1\n") do |dir|
+    assert_true require("rp_basic")
+    assert_false require("rp_basic")
+    assert_false require("rp_basic.rb")
+    assert_equal 1, $rp_basic
+    assert_true $".include?("#{dir}/rp_basic.rb")
+  end
+end
+
+assert("require - missing feature") do
+  assert_raise(LoadError) { require "rp_no_such_feature" }
+end
+
+assert("require_relative") do
+  files = {
+    "rp_rel/a.rb" => "require_relative 'b'\n$rp_rel_a = $rp_rel_b\n",
+    "rp_rel/b.rb" => "$rp_rel_b = :b\n",
+  }
+  RequirePlusTest.loadpath(files) do |dir|
+    assert_true require("rp_rel/a")
+    assert_equal :b, $rp_rel_a
+    assert_true $".include?("#{dir}/rp_rel/b.rb")
+  end
+end
+
+assert("require - already loaded feature does not allocate") do
+  RequirePlusTest.loadpath("rp_cached.rb" => "") do
+    assert_true require("rp_cached")
+    assert_false require("rp_cached") # スタックを伸ばしておく
+    assert_equal 0, RequirePlusTest.count_allocations { require "rp_cached" }
+  end
+end
+
+assert("require - index is dropped when $: changes") do
+  RequirePlusTest.loadpath("rp_shadow.rb" => "$rp_shadow = :first\n") do
+    assert_true require("rp_shadow")
+    RequirePlusTest.loadpath("rp_shadow.rb" => "$rp_shadow = :second\n") do
+      assert_true require("rp_shadow")
+      assert_equal :second, $rp_shadow
+    end
+  end
+end
+
+assert("require - compressed file") do
+  # tools/compress.rb で "$rp_z = :z\n" を圧縮したもの (リテラルだけの LZ4 ブロック)
+  data = "RP+Z\0\0\0\v\xb0$rp_z = :z\n"
+  RequirePlusTest.loadpath("rp_z.rb.z" => data) do |dir|
+    assert_true require("rp_z")
+    assert_equal :z, $rp_z
+    assert_true $".include?("#{dir}/rp_z.rb")
+    assert_false require("rp_z.rb")
+  end
+end
+
+assert("require - load path directory replaced behind a symlink") do
+  skip "needs symlink()" unless RequirePlusTest.respond_to?(:symlink)
+
+  RequirePlusTest.tmpdir("a/rp_swap.rb" => "$rp_swap = :a\n", "b/rp_swap.rb" => "$rp_swap = :b\n") do |dir|
+    RequirePlusTest.symlink("a", "#{dir}/cur")
+    $:.unshift "#{dir}/cur"
+    begin
+      assert_nil RequirePlus.try_require("rp_swap_none")
+      RequirePlusTest.symlink("b", "#{dir}/cur")
+      assert_true require("rp_swap")
+      assert_equal :b, $rp_swap
+    ensure
+      $:.delete "#{dir}/cur"
+    end
+  end
+end
+
+assert("RequirePlus::Central.sysfile_read") do
+  RequirePlusTest.tmpdir("rp_read.rb" => "data", "rp_sub/x" => "") do |dir|
+    assert_equal "data", RequirePlus::Central.sysfile_read(dir, "rp_read.rb")
+    assert_nil RequirePlus::Central.sysfile_read(dir, "rp_none.rb")
+    assert_raise(LoadError) { RequirePlus::Central.sysfile_read(dir, "rp_sub") }
+  end
+end
+
+assert("load - compiled code is not reused for a replaced file") do
+  RequirePlusTest.tmpdir do |dir|
+    path = "#{dir}/rp_load.rb"
+    RequirePlusTest.replace(path, "$rp_load = 1\n", 1000000000)
+    assert_true load(path)
+    assert_equal 1, $rp_load
+    # 大きさと更新時刻は同じだが、別のファイルに置き換えられている
+    RequirePlusTest.replace(path, "$rp_load = 2\n", 1000000000)
+    assert_true load(path)
+    assert_equal 2, $rp_load
+  end
+end
+
+assert("require - $: replaced by a plain Array") do
+  RequirePlusTest.tmpdir("rp_plain.rb" => "$rp_plain = :found\n") do |dir|
+    assert_nil RequirePlus.try_require("rp_plain")
+    saved = $:
+    begin
+      $: += [dir]
+      assert_true require("rp_plain")
+      assert_equal :found, $rp_plain
+    ensure
+      $: = saved
+    end
+  end
+end
+
+assert("require - $: changed by mrb_ary_push()") do
+  RequirePlusTest.tmpdir("rp_arypush.rb" => "") do |dir|
+    assert_nil RequirePlus.try_require("rp_arypush")
+    # RequirePlus::LoadPath のメソッドを通らない変更
+    RequirePlusTest.ary_push($:, dir)
+    begin
+      assert_true RequirePlus.try_require("rp_arypush")
+    ensure
+      $:.delete dir
+    end
+  end
+end
+
+assert("RequirePlus.unload") do
+  RequirePlusTest.loadpath("rp_unload.rb" => "$rp_unload = ($rp_unload || 0) + 1\n") do |dir|
+    assert_false RequirePlus.unload("rp_unload")
+    assert_true require("rp_unload")
+    assert_true RequirePlus.unload("rp_unload")
+    assert_false $".include?("#{dir}/rp_unload.rb")
+    assert_false RequirePlus.unload("rp_unload")
+    assert_true require("rp_unload")
+    assert_equal 2, $rp_unload
+    assert_true RequirePlus.unload("#{dir}/rp_unload.rb")
+  end
+end
+
+assert("RequirePlus.try_require") do
+  files = {
+    "rp_try.rb" => "$rp_try = ($rp_try || 0) + 1\n",
+    "rp_try_broken.rb" => "require 'rp_try_none'\n",
+  }
+  RequirePlusTest.loadpath(files) do
+    assert_nil RequirePlus.try_require("rp_try_none")
+    assert_true RequirePlus.try_require("rp_try")
+    assert_false RequirePlus.try_require("rp_try")
+    assert_equal 1, $rp_try
+    # 読み込んだファイルの中の LoadError は nil にならずに伝わる
+    assert_raise(LoadError) { RequirePlus.try_require("rp_try_broken") }
+  end
+end
+
+assert("RequirePlus.try_require - missing result is forgotten when $: changes") do
+  RequirePlusTest.loadpath do
+    assert_nil RequirePlus.try_require("rp_try_later")
+    RequirePlusTest.loadpath("rp_try_later.rb" => "") do
+      assert_true RequirePlus.try_require("rp_try_later")
+    end
+  end
+end
+
+assert("RequirePlus.unload - compiled code kept by load") do
+  RequirePlusTest.tmpdir("rp_unload_load.rb" => "$rp_unload_load = ($rp_unload_load || 0) + 1\n") do |dir|
+    path = "#{dir}/rp_unload_load.rb"
+    cache = RequirePlus::Central::LOAD_CACHE
+    keys = cache.keys
+    assert_true load(path)
+    added = cache.keys - keys
+    assert_equal 1, added.size
+    assert_true RequirePlus.unload(path)
+    assert_false cache.key?(added[0])
+    assert_false RequirePlus.unload(path)
+    assert_true load(path)
+    assert_equal 2, $rp_unload_load
+  end
+end
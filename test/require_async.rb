@@ -0,0 +1,26 @@
+#!ruby
+
+assert("RequirePlus.require_async") do
+  RequirePlusTest.loadpath("rp_async.rb" => "$rp_async = :loaded\n") do |dir|
+    req = RequirePlus.require_async("rp_async")
+    assert_equal "rp_async", req.feature
+    assert_nil $rp_async
+    assert_true req.value
+    assert_true req.done?
+    assert_equal :loaded, $rp_async
+    assert_true $".include?("#{dir}/rp_async.rb")
+    assert_false RequirePlus.require_async("rp_async").value
+  end
+end
+
+assert("RequirePlus.require_async - missing feature") do
+  assert_raise(LoadError) { RequirePlus.require_async("rp_async_none") }
+end
+
+assert("RequirePlus.require_async - failure is raised by value") do
+  RequirePlusTest.loadpath("rp_async_bad.rb" => "raise 'rp_async_bad'\n") do
+    req = RequirePlus.require_async("rp_async_bad")
+    assert_raise(RuntimeError) { req.value }
+    assert_raise(RuntimeError) { req.value }
+  end
+end
@@ -0,0 +1,86 @@
+#!ruby
+
+assert("RequirePlus.require_many") do
+  files = {
+    "rp_many_a.rb" => "($rp_many ||= []) << :a\n",
+    "rp_many/b.rb" => "($rp_many ||= []) << :b\n",
+    # tools/compress.rb で "($rp_many ||= []) << :c\n" を圧縮したもの
+    "rp_many/c.rb.z" => "RP+Z\0\0\0\x18\xf0\x09($rp_many ||= []) << :c\n",
+  }
+  RequirePlusTest.loadpath(files) do |dir|
+    assert_equal [true, true, true], RequirePlus.require_many(%w(rp_many/b rp_many_a rp_many/c))
+    assert_equal [:b, :a, :c], $rp_many
+    assert_true $".include?("#{dir}/rp_many/c.rb")
+    assert_equal [false], RequirePlus.require_many(%w(rp_many/b))
+  end
+end
+
+assert("RequirePlus.require_many - same order as require") do
+  files = {
+    "rp_many_pref.rb" => "$rp_many_pref = :rb\n",
+    "rp_many_pref.mrb" => "",
+    "rp_many_pref.so" => "",
+  }
+  RequirePlusTest.loadpath(files) do |dir|
+    assert_equal [true], RequirePlus.require_many(%w(rp_many_pref))
+    assert_equal :rb, $rp_many_pref
+    assert_true $".include?("#{dir}/rp_many_pref.rb")
+  end
+end
+
+assert("RequirePlus.require_many - missing feature") do
+  RequirePlusTest.loadpath("rp_many_ok.rb" => "") do
+    assert_raise(LoadError) { RequirePlus.require_many(%w(rp_many_ok rp_many_none)) }
+  end
+end
+
+class RequirePlusTest::MemVFS
+  attr_reader :reads
+
+  def initialize(files)
+    @files = files
+    @reads = []
+  end
+
+  def to_path
+    "memvfs:#{object_id}"
+  end
+
+  def file?(path)
+    @files.has_key?(path)
+  end
+
+  def size(path)
+    (d = @files[path]) && d.bytesize
+  end
+
+  def read(path)
+    @reads << path
+    @files[path]
+  end
+
+  def read_many(paths)
+    paths.map { |path| @files[path] }
+  end
+end
+
+assert("RequirePlus.require_many - nested call keeps the outer prefetch") do
+  vfs = RequirePlusTest::MemVFS.new(
+    "rp_nest_a.rb" => "RequirePlus.require_many(%w(rp_nest_c))\n($rp_nest ||= []) << :a\n",
+    "rp_nest_b.rb" => "($rp_nest ||= []) << :b\n",
+    "rp_nest_c.rb" => "($rp_nest ||= []) << :c\n")
+  $:.unshift vfs
+  begin
+    assert_equal [true, true], RequirePlus.require_many(%w(rp_nest_a rp_nest_b))
+    assert_equal [:c, :a, :b], $rp_nest
+    # どれも read_many で読み込んだものが使われ、入れ子の呼び出しの後も rp_nest_b.rb の分は残っている
+    assert_equal [], vfs.reads
+  ensure
+    $:.delete vfs
+  end
+end
+
+assert("RequirePlus::Central::LOOKUP_EXTS is frozen") do
+  assert_true RequirePlus::Central::LOOKUP_EXTS.frozen?
+  assert_true RequirePlus::Central::LOOKUP_EXTS.all? { |e| e.frozen? }
+end
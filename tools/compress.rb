@@ -0,0 +1,97 @@
+#!ruby
+#
+# mruby-require-plus が読み込める圧縮ファイル (`.rb.z` や `.mrb.z`) を作成します。
+#
+#   ruby tools/compress.rb [-o OUTPUT] FILE...
+#
+# `-o` を省略した場合は `FILE.z` に書き出します。
+#
+# 形式は "RP+Z"、展開後のバイト数 (32 ビット ビッグエンディアン)、LZ4 ブロック形式のデータです。
+# 圧縮処理は単純な貪欲法ですが、出力は LZ4 の参照実装でも展開できます。
+#
+
+module RequirePlusCompress
+  MAGIC = "RP+Z".b
+  MINMATCH = 4
+  LASTLITERALS = 5        # 最後の 5 バイトは必ずリテラル
+  MFLIMIT = 12            # 最後の一致は末尾から 12 バイトより前で始まる
+  MAX_OFFSET = 65535
+  HASH_BITS = 16
+
+  def self.compress(src)
+    src = src.b
+    raise ArgumentError, "too large input (#{src.bytesize} bytes)" if src.bytesize > 0xffffffff
+
+    MAGIC + [src.bytesize].pack("N") + encode(src)
+  end
+
+  def self.encode(src)
+    out = "".b
+    len = src.bytesize
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = len - MFLIMIT
+
+    while pos < limit
+      key = src.byteslice(pos, MINMATCH)
+      cand = table[key]
+      table[key] = pos
+
+      if cand && pos - cand <= MAX_OFFSET
+        mlen = MINMATCH
+        mlimit = len - LASTLITERALS
+        mlen += 1 while pos + mlen < mlimit && src.getbyte(cand + mlen) == src.getbyte(pos + mlen)
+
+        emit(out, src.byteslice(anchor, pos - anchor), pos - cand, mlen)
+        pos += mlen
+        anchor = pos
+      else
+        pos += 1
+      end
+    end
+
+    emit(out, src.byteslice(anchor, len - anchor), nil, nil)
+    out
+  end
+
+  def self.emit(out, literal, offset, mlen)
+    llen = literal.bytesize
+    token = [llen, 15].min << 4
+    token |= [mlen - MINMATCH, 15].min if mlen
+    out << token.chr
+    putlength(out, llen)
+    out << literal
+    return out unless offset
+
+    out << [offset].pack("v")
+    putlength(out, mlen - MINMATCH)
+    out
+  end
+
+  def self.putlength(out, len)
+    return if len < 15
+
+    len -= 15
+    while len >= 255
+      out << 255.chr
+      len -= 255
+    end
+    out << len.chr
+  end
+end
+
+if $0 == __FILE__
+  require "optparse"
+
+  output = nil
+  opts = OptionParser.new
+  opts.banner = "usage: #{File.basename($0)} [-o OUTPUT] FILE..."
+  opts.on("-o OUTPUT", "output file (only for a single input)") { |o| output = o }
+  files = opts.parse(ARGV)
+  abort opts.help if files.empty? || (output && files.size > 1)
+
+  files.each do |file|
+    File.binwrite(output || file + ".z", RequirePlusCompress.compress(File.binread(file)))
+  end
+end